@@ -1,55 +1,580 @@
+#if defined(SHARED_MEMORY) || defined(QUERY_SERVER)
+#define _GNU_SOURCE         /* MAP_FIXED_NOREPLACE, accept4 */
+#else
+#define _POSIX_C_SOURCE 200809L     /* clock_gettime, threads and sockets with -std=c11 */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(PARALLEL_MERGE) || defined(COMBINING_WRITER) || defined(QUERY_LOADGEN)
+#include <pthread.h>
+#endif
+#ifdef COMBINING_WRITER
+#include <sched.h>
+#endif
+#if defined(COMPACTION_BENCHMARK) && defined(__GLIBC__)
+#include <malloc.h>
+#include <unistd.h>
+#endif
+#if defined(QUERY_SERVER) || defined(QUERY_LOADGEN)
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#ifdef QUERY_SERVER
+#include <sys/epoll.h>
+#endif
+#ifdef SHARED_MEMORY
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(SHARED_MEMORY) && defined(SELF_TEST)
+#include <signal.h>
+#include <sys/wait.h>
+#endif
 
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 #define min(a, b) (((a) < (b)) ? (a) : (b))
-#define EXTRA 10
 
-/* Product struct */
+/* balancing policies - choose one at compile time with -DBALANCE_POLICY=WAVL_POLICY */
+#define AVL_POLICY 0     /* heights differ by at most 1, deletions may rotate up to the root */
+#define WAVL_POLICY 1    /* rank differences 1 or 2, at most 2 rotations per insert or delete */
+#ifndef BALANCE_POLICY
+#define BALANCE_POLICY AVL_POLICY
+#endif
+#ifndef BALANCE_BENCHMARK
+#define balancePolicy BALANCE_POLICY
+#endif
+
+/* parallel merge - build with -DPARALLEL_MERGE -pthread to run unions on up to 2^MERGE_PARALLEL_DEPTH threads */
+#ifndef MERGE_PARALLEL_DEPTH
+#define MERGE_PARALLEL_DEPTH 3
+#endif
+#ifndef MERGE_MAX_THREADS
+#define MERGE_MAX_THREADS ((1 << MERGE_PARALLEL_DEPTH) - 1)    /* helper threads running unions at once, in all merges */
+#endif
+#define MERGE_GRAIN 4096    /* unions of fewer products run on the current thread */
+
+/* write buffer - once full, every add moves this many buffered products to the trees until it is empty */
+#ifndef BUFFER_DRAIN_STEP
+#define BUFFER_DRAIN_STEP 2
+#endif
+
+/* product key types - build with -DPRODUCT_TIME_TYPE="long long" for 64-bit times */
+#if !defined(PRODUCT_TIME_TYPE) && !defined(PRODUCT_QUALITY_TYPE)
+#define INT_KEYS            /* 32-bit keys, bucket time index can use SIMD kernels */
+#endif
+#ifndef PRODUCT_TIME_TYPE
+#define PRODUCT_TIME_TYPE int
+#endif
+#ifndef PRODUCT_QUALITY_TYPE
+#define PRODUCT_QUALITY_TYPE int
+#endif
+typedef PRODUCT_TIME_TYPE TimeType;
+typedef PRODUCT_QUALITY_TYPE QualityType;
+/* build with -DPRODUCT_QUALITY_FLOATING too if PRODUCT_QUALITY_TYPE is float or double */
+#if defined(QUALITY_SKETCH) && defined(PRODUCT_QUALITY_FLOATING)
+#error "quality sketches shift qualities into bins and need an integer PRODUCT_QUALITY_TYPE"
+#endif
+
+/* optional inline payload - build with -DPRODUCT_PAYLOAD_TYPE=<type> to store one in every product */
+#ifdef PRODUCT_PAYLOAD_TYPE
+typedef PRODUCT_PAYLOAD_TYPE PayloadType;
+#endif
+
+/* bucket time index - build with -DBUCKET_TIME_INDEX to answer time range queries from sorted blocks */
+#ifdef BUCKET_TIME_INDEX
+#ifdef SHARED_MEMORY
+#error "bucket time index is not allocated in shared memory"
+#endif
+#ifndef BUCKET_SIZE
+#define BUCKET_SIZE 32      /* products per leaf bucket, 16 to 64 */
+#endif
+/* vector kernels for 32-bit keys - build with -mavx2 or -msse4.1, scalar loops otherwise */
+#if defined(INT_KEYS) && defined(__AVX2__)
+#include <immintrin.h>
+typedef __m256i BucketVector;
+#define VECTOR_LANES 8
+#define VECTOR_LOAD(p) _mm256_loadu_si256((const __m256i*)(p))
+#define VECTOR_STORE(p, a) _mm256_storeu_si256((__m256i*)(p), a)
+#define VECTOR_SET(x) _mm256_set1_epi32(x)
+#define VECTOR_GREATER(a, b) _mm256_cmpgt_epi32(a, b)
+#define VECTOR_EQUAL(a, b) _mm256_cmpeq_epi32(a, b)
+#define VECTOR_MIN(a, b) _mm256_min_epi32(a, b)
+#define VECTOR_MASK(a) _mm256_movemask_ps(_mm256_castsi256_ps(a))
+#elif defined(INT_KEYS) && defined(__SSE4_1__)
+#include <smmintrin.h>
+typedef __m128i BucketVector;
+#define VECTOR_LANES 4
+#define VECTOR_LOAD(p) _mm_loadu_si128((const __m128i*)(p))
+#define VECTOR_STORE(p, a) _mm_storeu_si128((__m128i*)(p), a)
+#define VECTOR_SET(x) _mm_set1_epi32(x)
+#define VECTOR_GREATER(a, b) _mm_cmpgt_epi32(a, b)
+#define VECTOR_EQUAL(a, b) _mm_cmpeq_epi32(a, b)
+#define VECTOR_MIN(a, b) _mm_min_epi32(a, b)
+#define VECTOR_MASK(a) _mm_movemask_ps(_mm_castsi128_ps(a))
+#endif
+#endif
+
+/* dominance index - build with -DDOMINANCE_INDEX to count products in time & quality boxes in O(log^2n),
+   every product is kept once per level (O(nlogn) space, about 14 times the memory of the trees at 200000 products) */
+#ifdef DOMINANCE_INDEX
+#ifdef SHARED_MEMORY
+#error "dominance index is not allocated in shared memory"
+#endif
+#define DOMINANCE_BALANCE 7    /* subtree is rebuilt when a child holds more than 7/10 of its nodes */
+#endif
+
+/* online compaction - build with -DONLINE_COMPACTION to move products to contiguous blocks in traversal order */
+#ifdef ONLINE_COMPACTION
+#ifdef SHARED_MEMORY
+#error "compaction blocks are not allocated in shared memory"
+#endif
+#define COMPACT_MIN_BLOCK 64       /* products in smallest compaction block */
+#define COMPACT_MAX_BLOCK 16384    /* products in biggest compaction block, bigger mallocs can stall on allocator consolidation */
+#endif
+
+/* quality sketches - build with -DQUALITY_SKETCH to keep a quality histogram per time bucket for approximate quantiles */
+#ifdef QUALITY_SKETCH
+#ifdef SHARED_MEMORY
+#error "quality sketches are not allocated in shared memory"
+#endif
+#ifndef SKETCH_WIDTH
+#define SKETCH_WIDTH 1024          /* times per time bucket */
+#endif
+#ifndef SKETCH_PRECISION
+#define SKETCH_PRECISION 6         /* 2^6 bins per power of 2 - qualities below 128 are exact, others within 1/128 */
+#endif
+#endif
+
+/* lazy delete - build with -DLAZY_DELETE to mark removed products as tombstones and rebuild the trees once in a while */
+#ifdef LAZY_DELETE
+#ifndef TOMBSTONE_PERCENT
+#define TOMBSTONE_PERCENT 25       /* trees are rebuilt when more than 25% of their products are tombstones */
+#endif
+#endif
+
+/* shared memory - build with -DSHARED_MEMORY to host a data structure in a named segment mapped by reader processes */
+#ifdef SHARED_MEMORY
+#if (defined(__x86_64__) || defined(__aarch64__)) && !defined(__SANITIZE_THREAD__)     /* thread sanitizer keeps its shadow memory there */
+#define SHM_ADDRESS 0x200000000000UL   /* segments go high in the address space, away from heaps and libraries, so readers find it free */
+#else
+#define SHM_ADDRESS 0UL                /* no free region known, the kernel picks the address */
+#endif
+#define SHM_SLOTS 64                   /* segment addresses tried from SHM_ADDRESS */
+#define READ_CHECK_STEPS 256           /* reader walk steps between seqlock version checks */
+#define READ_STEP() readStep()
+#else
+#define READ_STEP() 1
+#endif
+
+/* Product struct - pointers first, so 32-bit and 64-bit keys pack without padding.
+   on 64-bit targets 72 bytes with int keys and 80 bytes with 64-bit keys, not counting payload */
 typedef struct Product
 {
-    int time;
-    int quality;
     struct Product* parent;
     struct Product* left;
     struct Product* right;
     struct Product* twin;           /* points to twin product in quality / time tree */
     struct Product* timeSubtree;    /* for quality tree, a pointer to same quality dif times subtree */
     struct Product* minQualityP;    /* points to the min quality product in subtree */
-    int height;                     /* height of product in AVL tree */
+#ifdef ONLINE_COMPACTION
+    struct CompactBlock* block;     /* compaction block holding product, NULL if it was not moved */
+#endif
+#ifdef PRODUCT_PAYLOAD_TYPE
+    PayloadType payload;            /* user data, stored inline in time tree products */
+#endif
+    TimeType time;
+    QualityType quality;
+    QualityType minQuality;         /* value of minimum quality in subtree */
+    int height;                     /* height of product in AVL tree (rank in WAVL tree) */
     int subtreeSize;                /* products subtree size */
-    int minQuality;                 /* value of minimum quality in subtree */
+#ifdef LAZY_DELETE
+    int dead;                       /* 1 for a removed product (tombstone), left out of subtree size and minimum */
+#endif
 } Product;
 
+/* heap entry - a single product or a whole subtree, keyed by its minimum product */
+typedef struct HeapEntry {
+    Product* product;          /* product / subtree root */
+    Product* key;              /* minimum product, read once when pushed */
+    int whole;                 /* 1 for the whole subtree, 0 for the product only */
+} HeapEntry;
+
+/* min heap of time tree pieces by quality & time */
+typedef struct ProductHeap {
+    HeapEntry* entries;
+    int size;
+    int capacity;
+    int failed;                /* 1 if memory allocation failed */
+} ProductHeap;
+
+/* union of two subtrees, run on its own thread in parallel merge */
+typedef struct UnionTask {
+    Product* a;                /* subtree to merge into */
+    Product* b;                /* subtree merged from */
+    Product* result;           /* merged subtree */
+    Product* dropped;          /* list of b's products already in a, linked by parent */
+    int quality;               /* 1 for quality subtrees, 0 for time subtrees */
+    int depth;                 /* recursion depth */
+} UnionTask;
+
+#ifdef BUCKET_TIME_INDEX
+
+/* leaf bucket - up to BUCKET_SIZE products sorted by time */
+typedef struct Bucket {
+    int count;                           /* number of products in bucket */
+    TimeType times[BUCKET_SIZE];         /* sorted times */
+    QualityType qualities[BUCKET_SIZE];  /* qualities of times */
+} Bucket;
+
+/* bucket index node - internal nodes route by splitTime, leaves hold a bucket */
+typedef struct BucketNode {
+    struct BucketNode* left;
+    struct BucketNode* right;
+    Bucket* bucket;            /* leaf bucket, NULL for internal nodes */
+    TimeType splitTime;        /* left subtree times are smaller, right subtree times are bigger or equal */
+    TimeType minTime;          /* time of the min quality product in subtree */
+    QualityType minQuality;    /* value of minimum quality in subtree */
+    int height;                /* height of node, leaves are 0 */
+    int subtreeSize;           /* products in subtree */
+} BucketNode;
+
+/* bucket heap entry - a whole subtree or a range of a leaf bucket, keyed by its minimum product */
+typedef struct BucketEntry {
+    BucketNode* node;
+    int lo;                    /* first index of leaf range */
+    int hi;                    /* last index of leaf range */
+    int index;                 /* index of minimum in leaf range */
+    TimeType time;             /* minimum product's time */
+    QualityType quality;       /* minimum product's quality */
+} BucketEntry;
+
+/* min heap of bucket index pieces by quality & time */
+typedef struct BucketHeap {
+    BucketEntry* entries;
+    int size;
+    int capacity;
+    int failed;                /* 1 if memory allocation failed */
+} BucketHeap;
+
+typedef BucketHeap RangeHeap;
+#else
+typedef ProductHeap RangeHeap;
+#endif
+
+#ifdef DOMINANCE_INDEX
+
+/* dominance index node - scapegoat tree by time, every node keeps a quality tree of its subtree's products */
+typedef struct DominanceNode {
+    struct DominanceNode* left;
+    struct DominanceNode* right;
+    Product* qualities;        /* quality tree of subtree's products, removed products excluded */
+    TimeType time;
+    QualityType quality;
+    int removed;               /* 1 if product was removed, node is dropped on next rebuild */
+    int size;                  /* nodes in subtree, removed nodes included */
+} DominanceNode;
+
+#endif
+
+#ifdef ONLINE_COMPACTION
+
+/* block of compacted products - filled in traversal order, freed when all its products are freed */
+typedef struct CompactBlock {
+    int capacity;              /* products block can hold */
+    int used;                  /* products moved to block so far, freed slots are not reused */
+    int live;                  /* products in block not freed yet */
+    int filling;               /* 1 while a compaction pass moves products to block */
+    Product products[];
+} CompactBlock;
+
+/* what compaction steps did, added up by CompactStep */
+typedef struct CompactionReport {
+    long moved;                /* products moved to compaction blocks */
+    long releasedBytes;        /* bytes returned to malloc or pool by moved products and emptied blocks */
+    long blockBytes;           /* bytes of compaction blocks allocated */
+} CompactionReport;
+
+/* sum of traversed times, keeps TraversalTime's loops from being optimized out */
+TimeType traversalChecksum = 0;
+
+#endif
+
+#ifdef QUALITY_SKETCH
+
+/* quality histogram of one time bucket - counts of log-linear quality bins, sorted by bin */
+typedef struct QualitySketch {
+    TimeType bucket;           /* time / SKETCH_WIDTH, rounded down */
+    int count;                 /* products in time bucket */
+    int size;                  /* bins used */
+    int capacity;              /* bins allocated */
+    int* bins;                 /* sorted bin numbers, see qualityBin */
+    int* counts;               /* products per bin */
+} QualitySketch;
+
+#endif
+
+/* number of rotations done so far, counted in benchmark and self test builds */
+long rotationCount = 0;
+
+#ifdef PARALLEL_MERGE
+/* number of parallel merge helper threads running, at most MERGE_MAX_THREADS */
+int mergeThreads = 0;
+#endif
+#ifdef BALANCE_BENCHMARK
+/* policy used by rebalancing, the benchmark switches it between runs */
+int balancePolicy = BALANCE_POLICY;
+#endif
+
+/* fixed size items allocator over one memory block (e.g. a shared memory segment) or over malloc'ed chunks */
+typedef struct MemoryPool {
+    void* freeList;            /* freed items, linked by their first pointer */
+    char* next;                /* first never used byte */
+    char* end;                 /* end of memory block */
+    size_t itemSize;           /* bytes per item, 16 byte aligned */
+    size_t chunkItems;         /* items per malloc'ed chunk, 0 for one fixed block */
+    void* chunks;              /* malloc'ed chunks, linked by their first pointer */
+} MemoryPool;
+
 /* Data Structre struct */
 typedef struct DataStructure {
     Product* timeRoot;         /* pointer to time AVL tree */
     Product* qualityRoot;      /* pointer to quality AVL tree */
-    int special;               /* keeps special quality */
+    QualityType special;       /* keeps special quality */
     int specialExists;         /* 1 if special quality exists, 0 otherwise*/
+    TimeType* bufferTime;      /* write buffer times, sorted by quality & time */
+    QualityType* bufferQuality;/* write buffer qualities */
+#ifdef PRODUCT_PAYLOAD_TYPE
+    PayloadType* bufferPayload;/* write buffer payloads */
+#endif
+    int bufferSize;            /* number of products in write buffer */
+    int bufferCapacity;        /* write buffer capacity, 0 if buffer is disabled */
+    int bufferDraining;        /* 1 from the time write buffer fills up until adds have moved it to the trees */
+    MemoryPool* pool;          /* products allocator, NULL for malloc */
+    MemoryPool* bufferPool;    /* write buffer arrays allocator, NULL for malloc */
+    int smallInstance;         /* 1 while all products are in write buffer, until it fills up and moves to the trees */
+    unsigned long version;     /* seqlock version, odd while a write is in progress */
+    int writeDepth;            /* nested writes of the writer */
+#ifdef BUCKET_TIME_INDEX
+    BucketNode* bucketRoot;    /* leaf bucketed time index, for time range queries */
+#endif
+#ifdef DOMINANCE_INDEX
+    DominanceNode* dominanceRoot;   /* time & quality box counting index */
+    int dominanceRemoved;      /* removed nodes still in dominance index */
+#endif
+#ifdef ONLINE_COMPACTION
+    CompactBlock* compactBlock;     /* block filled by the compaction pass, NULL if none - other blocks are freed by their last product */
+    int compactPhase;          /* 0 - no pass, 1 - moving time tree, 2 - moving quality tree */
+    int compactStep;           /* 0 - phase started, 1 - quality node moved, 2 - some of its products moved, 3 - quality done */
+    TimeType compactTime;      /* time of last moved product */
+    QualityType compactQuality;/* quality of last moved quality node */
+#endif
+#ifdef QUALITY_SKETCH
+    QualitySketch* sketches;   /* sketches of non empty time buckets, sorted by bucket */
+    int sketchCount;           /* number of sketches */
+    int sketchCapacity;        /* sketches allocated */
+#endif
+#ifdef LAZY_DELETE
+    int tombstones;            /* removed products still in both trees */
+#endif
 } DataStructure;
 
+/* many data structures, one per tenant, sharing their allocators */
+typedef struct TenantManager {
+    long* tenants;             /* tenant ids, open addressing by hash */
+    DataStructure** instances; /* data structure of each tenant, NULL for empty slots */
+    int capacity;              /* hash table slots, a power of 2 */
+    int count;                 /* number of tenants */
+    int smallThreshold;        /* products kept in arrays before a tenant moves to trees */
+    MemoryPool products;       /* products of all tenants */
+    MemoryPool arrays;         /* write buffer arrays of small tenants */
+    MemoryPool structures;     /* data structures of all tenants */
+} TenantManager;
+
+#ifdef COMBINING_WRITER
+
+/* combining writer operation types */
+#define OPERATION_ADD 0
+#define OPERATION_REMOVE 1
+#define WAIT_SPINS 64              /* sched_yield rounds WaitOperation spins before it sleeps */
+
+/* operation submitted by a producer thread, owned by it until done */
+typedef struct CombiningOperation {
+    int type;                  /* OPERATION_ADD or OPERATION_REMOVE */
+    TimeType time;
+    QualityType quality;       /* for OPERATION_ADD */
+    void (*callback)(struct CombiningOperation* operation, void* context);  /* called by combiner when done, may be NULL */
+    void* context;             /* callback argument */
+    int done;                  /* set by combiner after operation and callback are done */
+    struct CombiningOperation* next;    /* pending operations list link */
+    struct CombiningWriter* writer;     /* combiner it was submitted to */
+} CombiningOperation;
+
+/* single combiner thread applying operations of many producer threads to one data structure */
+typedef struct CombiningWriter {
+    DataStructure* ds;
+    CombiningOperation* pending;    /* lock free stack of submitted operations, newest first */
+    int sleeping;              /* 1 while combiner waits for operations */
+    int stopping;              /* 1 after StopCombiner */
+    int waiters;               /* producers sleeping in WaitOperation */
+    pthread_t thread;
+    pthread_mutex_t lock;      /* guards combiner and producer sleep */
+    pthread_cond_t wake;
+    pthread_cond_t finished;   /* signaled after a batch if producers sleep */
+} CombiningWriter;
+
+#endif
+
+#ifdef SHARED_MEMORY
+/* shared memory segment header - followed by the products */
+typedef struct SharedHeader {
+    DataStructure ds;          /* hosted data structure, first so a DataStructure* is the segment address */
+    MemoryPool pool;          /* products allocator over rest of the segment */
+    void* base;                /* address the segment is mapped at in every process */
+    size_t size;               /* segment size in bytes */
+} SharedHeader;
+
+/* read in progress on this thread, see readStep */
+_Thread_local DataStructure* readStructure = NULL;
+_Thread_local unsigned long readVersion = 0;
+_Thread_local long readSteps = 0;
+_Thread_local int readTorn = 0;     /* 1 once a write ran since ReadBegin */
+#endif
+
+#if defined(QUERY_SERVER) || defined(QUERY_LOADGEN)
+
+/* query server - build with -DQUERY_SERVER for the server and -DQUERY_LOADGEN for its load generator, same key types on both */
+#define SERVER_SOCKET "/tmp/avl-server.sock"     /* default Unix socket path */
+#define SERVER_BATCH 1024          /* requests read and answered per connection at once */
+#define SERVER_BUFFER 64           /* server data structure's write buffer capacity */
+
+/* query server operations */
+#define SERVER_INIT 0              /* Init(quality), drops all products */
+#define SERVER_ADD 1               /* AddProduct(time1, quality) */
+#define SERVER_REMOVE 2            /* RemoveProduct(time1) */
+#define SERVER_REMOVE_QUALITY 3    /* RemoveQuality(quality) */
+#define SERVER_ITH 4               /* GetIthRankProduct(rank) */
+#define SERVER_ITH_BETWEEN 5       /* GetIthRankProductBetween(time1, time2, rank) */
+#define SERVER_EXISTS 6            /* Exists() */
+
+/* fixed size request frame, in host byte order */
+typedef struct ServerRequest {
+    TimeType time1;            /* time, or first time bound */
+    TimeType time2;            /* second time bound */
+    QualityType quality;       /* quality, or special quality of SERVER_INIT */
+    int operation;             /* SERVER_INIT to SERVER_EXISTS */
+    int rank;                  /* i of rank queries */
+} ServerRequest;
+
+/* fixed size response frame, responses of a connection come in its requests' order */
+typedef struct ServerResponse {
+    TimeType result;           /* found time, or Exists result */
+    int status;                /* 1 if done or found, 0 if not found, not added or bad operation */
+} ServerResponse;
+
+#endif
+
 /*--------------- DECLARATIONS ---------------*/
 
 /* Data Structre functions */
-DataStructure Init(int s);
-void AddProduct(DataStructure* ds, int time, int quality);
-void RemoveProduct(DataStructure* ds, int time);
-void RemoveQuality(DataStructure* ds, int quality);
-int GetIthRankProduct(DataStructure ds, int i);
-int GetIthRankProductBetween(DataStructure ds, int time1, int time2, int i);
+DataStructure Init(QualityType s);
+int AddProduct(DataStructure* ds, TimeType time, QualityType quality);
+void RemoveProduct(DataStructure* ds, TimeType time);
+void RemoveQuality(DataStructure* ds, QualityType quality);
+TimeType GetIthRankProduct(DataStructure ds, int i);
+TimeType GetIthRankProductBetween(DataStructure ds, TimeType time1, TimeType time2, int i);
 int Exists(DataStructure ds);
+DataStructure InitBuffered(QualityType s, int capacity);
+void FlushBuffer(DataStructure* ds);
+int FindIthRankProduct(DataStructure ds, int i, TimeType* time);
+int FindIthRankProductBetween(DataStructure ds, TimeType time1, TimeType time2, int i, TimeType* time);
+#ifdef PRODUCT_PAYLOAD_TYPE
+int AddProductWithPayload(DataStructure* ds, TimeType time, QualityType quality, PayloadType payload);
+int GetProductPayload(DataStructure ds, TimeType time, PayloadType* payload);
+#endif
+int Merge(DataStructure* dst, DataStructure* src);
+unsigned long ReadBegin(DataStructure* ds);
+int ReadRetry(DataStructure* ds, unsigned long version);
+#ifdef SHARED_MEMORY
+DataStructure* ShmCreate(const char* name, QualityType s, size_t size);
+DataStructure* ShmAttach(const char* name);
+void ShmDetach(DataStructure* ds);
+#endif
+int CountBetween(DataStructure ds, TimeType time1, TimeType time2);
+int CountInBox(DataStructure ds, TimeType time1, TimeType time2, QualityType quality1, QualityType quality2);
+int QualityQuantileBetween(DataStructure ds, TimeType time1, TimeType time2, double q, QualityType* quality);
+#ifdef ONLINE_COMPACTION
+int CompactStep(DataStructure* ds, int budget, CompactionReport* report);
+double TraversalTime(DataStructure ds);
+#endif
+#ifdef QUALITY_SKETCH
+QualityType ApproxQualityQuantile(DataStructure ds, TimeType time1, TimeType time2, double q, int* err);
+#endif
+#ifdef LAZY_DELETE
+int PurgeTombstones(DataStructure* ds);
+#endif
+DataStructure InitSmall(QualityType s, int threshold);
+TenantManager InitManager(int smallThreshold);
+DataStructure* AddTenant(TenantManager* manager, long tenant, QualityType s);
+DataStructure* GetTenant(TenantManager* manager, long tenant);
+void RemoveTenant(TenantManager* manager, long tenant);
+void FreeManager(TenantManager* manager);
+#ifdef COMBINING_WRITER
+CombiningWriter* StartCombiner(DataStructure* ds);
+void StopCombiner(CombiningWriter* writer);
+void SubmitOperation(CombiningWriter* writer, CombiningOperation* operation);
+int OperationDone(CombiningOperation* operation);
+void WaitOperation(CombiningOperation* operation);
+void CombinedAddProduct(CombiningWriter* writer, TimeType time, QualityType quality);
+void CombinedRemoveProduct(CombiningWriter* writer, TimeType time);
+#endif
+/* Allocation and writer functions */
+MemoryPool initPool(size_t itemSize, size_t chunkItems);
+void* poolAlloc(MemoryPool* pool);
+void poolFree(MemoryPool* pool, void* x);
+void freePool(MemoryPool* pool);
+int poolHasSpace(MemoryPool* pool, int count);
+Product* allocProduct(MemoryPool* pool);
+void freeProduct(MemoryPool* pool, Product* x);
+void* allocArray(MemoryPool* pool, size_t size);
+void freeArray(MemoryPool* pool, void* x);
+void releaseBuffer(DataStructure* ds);
+void freeTimeTree(MemoryPool* pool, Product* root);
+void freeQualityTree(MemoryPool* pool, Product* root);
+void freeInstance(DataStructure* ds);
+/* Tenant manager functions */
+int tenantSlot(TenantManager* manager, long tenant);
+int growTenants(TenantManager* manager);
+void writeBegin(DataStructure* ds);
+void writeEnd(DataStructure* ds);
+#ifdef SHARED_MEMORY
+int readStep(void);
+#endif
+/* Write buffer functions */
+int bufferFindTime(DataStructure* ds, TimeType time);
+void bufferInsert(DataStructure* ds, TimeType time, QualityType quality);
+void bufferRemoveAt(DataStructure* ds, int index);
+void drainBuffer(DataStructure* ds, int count);
+int bufferHasQuality(DataStructure* ds, QualityType quality);
+int compareProducts(TimeType time1, QualityType quality1, TimeType time2, QualityType quality2);
 /* Time tree functions */
-Product* creatNewProduct(int newTime, int newQuality);
-Product* searchTime(Product* root, int time);
+Product* creatNewProduct(MemoryPool* pool, TimeType newTime, QualityType newQuality);
+Product* searchTime(Product* root, TimeType time);
 Product* insertTime(Product* root, Product* x);
-Product* removeProductFromTime(Product* root, int time);
+Product* removeProductFromTime(MemoryPool* pool, Product* root, TimeType time);
 Product* findIthTime(Product* root, int i);
 /* Quality tree functions */
-Product* createQualityNode(int newQuality);
-Product* searchQuality(Product* root, int quality);
-Product* insertQuality(Product* root, Product* x);
-Product* removeProductFromQuality(Product* root, int time, int quality);
+Product* createQualityNode(MemoryPool* pool, QualityType newQuality);
+Product* searchQuality(Product* root, QualityType quality);
+Product* insertQuality(MemoryPool* pool, Product* root, Product* x);
+Product* removeProductFromQuality(MemoryPool* pool, Product* root, TimeType time, QualityType quality);
 Product* findIthQuality(Product* root, int i);
 /* AVL general functions */
 void swapProduct(Product* a, Product* b);
@@ -58,862 +583,6044 @@ void updateHeight(Product* x);
 Product* minProduct(Product* root);
 Product* maxProduct(Product* root);
 Product* minOfTwoProducts(Product* x, Product* y);
-Product* minQualityPointer(Product* x, Product* y);
+Product* liveProduct(Product* x);
+int productWeight(Product* x);
 void updateMinQuality(Product* x);
 Product* rightRotate(Product* x);
 Product* leftRotate(Product* x);
 Product* balance(Product* x);
+int nodeRank(Product* x);
+Product* rebalanceInsert(Product* x);
+Product* rebalanceDelete(Product* x);
+Product* avlRebalanceInsert(Product* x);
+Product* avlRebalanceDelete(Product* x);
+Product* wavlRebalanceInsert(Product* x);
+Product* wavlRebalanceDelete(Product* x);
 int timeSubtreeSize(Product* qualityRoot);
-Product* findTimeOrSuccessor(Product* root, int time);
-Product* findTimeOrPredecessor(Product* root, int time);
-Product* minProductLeft(Product* root, Product* min, int time1, int time2);
-Product* minProductRight(Product* root, Product* min, int time1, int time2);
-Product* findMinQualityBetween(Product* root, int left, int right);
-int isInRange(Product* x, int time1, int time2);
-int countProducts(Product* root, int time1, int time2);
-Product* updateToNewQuality(Product* root, int time, int newQuality);
+Product* findTimeOrSuccessor(Product* root, TimeType time);
+Product* findTimeOrPredecessor(Product* root, TimeType time);
+Product* findMinQualityBetween(Product* root, TimeType left, TimeType right);
+int isInRange(Product* x, TimeType time1, TimeType time2);
+int countProducts(Product* root, TimeType time1, TimeType time2);
+int countSmallerTimes(Product* root, TimeType time);
+int countTimesUpTo(Product* root, TimeType time);
+int countSmallerProducts(Product* qualityRoot, TimeType time, QualityType quality);
+/* Product heap functions */
+Product* heapKey(HeapEntry entry);
+int heapPush(ProductHeap* heap, Product* x, int whole);
+HeapEntry heapPop(ProductHeap* heap);
+void heapInitRange(ProductHeap* heap, Product* root, TimeType left, TimeType right);
+Product* nextMinQuality(ProductHeap* heap);
+/* Time range functions - served by time tree or bucket time index */
+int rangeCount(DataStructure* ds, TimeType left, TimeType right);
+int rangeMin(DataStructure* ds, TimeType left, TimeType right, TimeType* time, QualityType* quality);
+void rangeHeapInit(RangeHeap* heap, DataStructure* ds, TimeType left, TimeType right);
+int rangeHeapNext(RangeHeap* heap, TimeType* time, QualityType* quality);
+#ifdef ONLINE_COMPACTION
+/* Compaction functions */
+Product* compactAlloc(DataStructure* ds, int capacity, CompactionReport* report);
+long compactRelease(Product* x);
+void compactClose(DataStructure* ds);
+void freeCompactBlocks(DataStructure* ds);
+Product* relocateProduct(DataStructure* ds, Product* x, Product** root, int capacity, CompactionReport* report);
+Product* successorProduct(Product* x);
+Product* timeAfter(Product* root, TimeType time);
+Product* qualityAfter(Product* root, QualityType quality, int inclusive);
+#endif
+#ifdef QUALITY_SKETCH
+/* Quality sketch functions */
+TimeType timeBucket(TimeType time);
+int qualityBin(QualityType quality);
+QualityType binQuality(int bin);
+int sketchIndex(DataStructure* ds, TimeType bucket);
+int sketchFind(DataStructure* ds, TimeType bucket, int create);
+void sketchAdd(DataStructure* ds, TimeType time, QualityType quality, int count);
+void sketchBinAdd(DataStructure* ds, int index, int bin, int count);
+void sketchMerge(DataStructure* dst, DataStructure* src);
+void freeSketches(DataStructure* ds);
+#endif
+#ifdef LAZY_DELETE
+/* Lazy delete functions */
+void tombstoneProduct(DataStructure* ds, Product* x);
+void removeTombstone(DataStructure* ds, Product* x);
+int tombstonesDue(DataStructure* ds);
+int collectLive(MemoryPool* pool, Product* root, Product** nodes, int count);
+int purgeQualities(MemoryPool* pool, Product* root, Product** qualities, int count, Product** nodes);
+Product* buildBalanced(Product** nodes, int lo, int hi);
+#endif
+/* Box counting functions - served by quality tree or dominance index */
+int countQualities(Product* qualityRoot, QualityType quality, int inclusive);
+int boxCount(DataStructure* ds, TimeType left, TimeType right, QualityType quality, int inclusive);
+int bufferBoxCount(DataStructure* ds, TimeType left, TimeType right, QualityType quality, int inclusive);
+#ifdef DOMINANCE_INDEX
+/* Dominance index functions */
+DominanceNode* dominanceInsert(DominanceNode* root, TimeType time, QualityType quality, int* removed);
+DominanceNode* dominanceRemove(DominanceNode* root, TimeType time, QualityType quality, int* removed);
+DominanceNode* dominanceMerge(DominanceNode* root, Product* dstTimes, Product* srcTimes, int* removed);
+DominanceNode* dominanceRebuild(DominanceNode* root, int* removed);
+int dominanceCollect(DominanceNode* root, DominanceNode** nodes, int count, int* removed);
+DominanceNode* dominanceBuild(DominanceNode** nodes, int lo, int hi);
+void freeDominance(DominanceNode* root);
+int dominanceCount(DominanceNode* x, TimeType left, TimeType right, int openLeft, int openRight, QualityType quality, int inclusive);
+#else
+int qualityBoxCount(Product* qualityRoot, TimeType left, TimeType right, QualityType quality, int inclusive);
+#endif
+#ifdef BUCKET_TIME_INDEX
+/* Bucket time index functions */
+int bucketCountTimes(const TimeType* times, int n, TimeType time, int inclusive);
+int bucketMinIndex(const QualityType* qualities, int lo, int hi);
+BucketNode* createBucket(void);
+void updateBucketNode(BucketNode* x);
+BucketNode* bucketRotateRight(BucketNode* x);
+BucketNode* bucketRotateLeft(BucketNode* x);
+BucketNode* balanceBucket(BucketNode* x);
+BucketNode* bucketInsert(BucketNode* root, TimeType time, QualityType quality);
+BucketNode* bucketInsertLeaf(BucketNode* leaf, TimeType time, QualityType quality);
+BucketNode* bucketRemove(BucketNode* root, TimeType time);
+BucketNode* bucketMerge(BucketNode* dst, BucketNode* src);
+void freeBuckets(BucketNode* root);
+int bucketCountUpTo(BucketNode* root, TimeType time, int inclusive);
+int bucketMinBetween(BucketNode* x, TimeType left, TimeType right, int openLeft, int openRight, TimeType* time, QualityType* quality);
+int bucketHeapPush(BucketHeap* heap, BucketNode* x, int lo, int hi);
+BucketEntry bucketHeapPop(BucketHeap* heap);
+void bucketPushRange(BucketHeap* heap, BucketNode* x, TimeType left, TimeType right, int openLeft, int openRight);
+#endif
+/* Join based merge functions */
+void updateSubtreeSize(Product* x);
+Product* joinNode(Product* left, Product* x, Product* right);
+Product* joinRight(Product* left, Product* x, Product* right);
+Product* joinLeft(Product* left, Product* x, Product* right);
+Product* joinTrees(Product* left, Product* x, Product* right);
+Product* splitTime(Product* root, TimeType time, Product** left, Product** right);
+Product* splitQuality(Product* root, QualityType quality, Product** left, Product** right);
+Product* unionTimes(Product* a, Product* b, Product** dropped, int depth);
+Product* unionQualities(Product* a, Product* b, Product** dropped, int depth);
+Product* unionChildren(Product* a, Product* l1, Product* r1, Product* l2, Product* r2, Product** dropped, int quality, int depth);
+void appendDropped(Product** dropped, Product* list);
+void* unionTask(void* arg);
+#ifdef COMBINING_WRITER
+/* Combining writer functions */
+CombiningOperation* sortOperations(CombiningOperation* list, int count);
+void applyOperations(CombiningWriter* writer, CombiningOperation* list);
+void* combinerTask(void* arg);
+#endif
+#ifdef QUERY_SERVER
+/* Query server functions */
+int serverReadOnly(int operation);
+int serverTimeWrite(int operation);
+int compareTimeWrites(const void* a, const void* b);
+ServerResponse serveRequest(DataStructure* ds, ServerRequest* request);
+void serveBatch(DataStructure* ds, ServerRequest* requests, int count, ServerResponse* responses);
+#endif
 
 /*--------------- DATA STRACTURE ---------------*/
 
 /* FUNCTION 1 - initiallize data structure and return it */
-DataStructure Init(int s)
+DataStructure Init(QualityType s)
 {
     DataStructure newDS;
     newDS.timeRoot = NULL;
     newDS.qualityRoot = NULL;
     newDS.special = s;
     newDS.specialExists = 0;
+    newDS.bufferTime = NULL;
+    newDS.bufferQuality = NULL;
+#ifdef PRODUCT_PAYLOAD_TYPE
+    newDS.bufferPayload = NULL;
+#endif
+    newDS.bufferSize = 0;
+    newDS.bufferCapacity = 0;
+    newDS.bufferDraining = 0;
+    newDS.pool = NULL;
+    newDS.bufferPool = NULL;
+    newDS.smallInstance = 0;
+    newDS.version = 0;
+    newDS.writeDepth = 0;
+#ifdef BUCKET_TIME_INDEX
+    newDS.bucketRoot = NULL;
+#endif
+#ifdef DOMINANCE_INDEX
+    newDS.dominanceRoot = NULL;
+    newDS.dominanceRemoved = 0;
+#endif
+#ifdef ONLINE_COMPACTION
+    newDS.compactBlock = NULL;
+    newDS.compactPhase = 0;
+    newDS.compactStep = 0;
+#endif
+#ifdef QUALITY_SKETCH
+    newDS.sketches = NULL;
+    newDS.sketchCount = 0;
+    newDS.sketchCapacity = 0;
+#endif
+#ifdef LAZY_DELETE
+    newDS.tombstones = 0;
+#endif
     return newDS;
 }
 
-/* FUNCTION 2 - adds a product to time tree and quality tree (O(logn)) */
-void AddProduct(DataStructure* ds, int time, int quality)
+/* FUNCTION 2 - adds a product to time tree and quality tree, returns 1 if added, 0 if the allocator is full (O(logn)) */
+int AddProduct(DataStructure* ds, TimeType time, QualityType quality)
 {
     Product *timeProduct, *newTimeRoot;
     Product *qualityProduct, *newQualityRoot;
 
+#ifdef LAZY_DELETE
+    /* tombstones hold pool items until the trees are rebuilt (O(n)) */
+    if (!poolHasSpace(ds->pool, 3) && ds->tombstones > 0) PurgeTombstones(ds);
+#endif
+    /* no room for two products and a quality node */
+    if (!poolHasSpace(ds->pool, 3)) return 0;
+    writeBegin(ds);
+
+#ifdef LAZY_DELETE
+    /* a tombstone with the same time is removed first, so times stay unique (O(logn)) */
+    timeProduct = searchTime(ds->timeRoot, time);
+    if (timeProduct != NULL && timeProduct->time == time && !productWeight(timeProduct)) removeTombstone(ds, timeProduct);
+#endif
+
+    /* check if special quality */
+    if (quality == ds->special) ds->specialExists = 1;
+#ifdef QUALITY_SKETCH
+    sketchAdd(ds, time, quality, 1);
+#endif
+
+    /* write buffer mode - insert to buffer, once it is full move a few products to the trees per add (O(capacity + logn)) */
+    if (ds->bufferCapacity > 0)
+    {
+        bufferInsert(ds, time, quality);
+        if (ds->bufferSize == ds->bufferCapacity)
+        {
+            /* small instance grew - keep using the trees only */
+            if (ds->smallInstance)
+            {
+                FlushBuffer(ds);
+                releaseBuffer(ds);
+            }
+            else ds->bufferDraining = 1;
+        }
+        if (ds->bufferDraining)
+        {
+            drainBuffer(ds, min(BUFFER_DRAIN_STEP, ds->bufferSize));
+            if (ds->bufferSize == 0) ds->bufferDraining = 0;
+        }
+        writeEnd(ds);
+        return 1;
+    }
+
     /* create a new product and insert to time tree (O(logn)) */
-    timeProduct = creatNewProduct(time, quality);
+    timeProduct = creatNewProduct(ds->pool, time, quality);
     newTimeRoot = insertTime(ds->timeRoot, timeProduct);
     ds->timeRoot = newTimeRoot;
 
     /* create a new product and insert to quality tree (O(logn)) */
-    qualityProduct = creatNewProduct(time, quality);
-    newQualityRoot = insertQuality(ds->qualityRoot, qualityProduct);
+    qualityProduct = creatNewProduct(ds->pool, time, quality);
+    newQualityRoot = insertQuality(ds->pool, ds->qualityRoot, qualityProduct);
     ds->qualityRoot = newQualityRoot;
 
     /* update twin pointers */
     timeProduct->twin = qualityProduct;
     qualityProduct->twin = timeProduct;
-
-    /* check if special quality */
-    if (quality == ds->special) ds->specialExists = 1;
+#ifdef BUCKET_TIME_INDEX
+    ds->bucketRoot = bucketInsert(ds->bucketRoot, time, quality);
+#endif
+#ifdef DOMINANCE_INDEX
+    ds->dominanceRoot = dominanceInsert(ds->dominanceRoot, time, quality, &ds->dominanceRemoved);
+#endif
+    writeEnd(ds);
+    return 1;
 }
 
 /* FUNCTION 3 - remove a product by time from both trees (O(logn)) */
-void RemoveProduct(DataStructure* ds, int time)
+void RemoveProduct(DataStructure* ds, TimeType time)
 {
-    Product *productToDelete, *newTimeRoot, *newQualityRoot, *qualitySearch;
-    int quality;
-    
-    /* find product to remove's quality (O(logn)) */
-    productToDelete = searchTime(ds->timeRoot, time);
-    if (productToDelete == NULL || productToDelete->time != time) return;   /* product not found */
-    quality = productToDelete->quality;                                 /* get products quality */
+    Product *productToDelete, *qualitySearch;
+#ifndef LAZY_DELETE
+    Product *newTimeRoot, *newQualityRoot;
+#endif
+    QualityType quality;
+    int index;
+
+    /* product is still in write buffer (O(capacity)) */
+    index = bufferFindTime(ds, time);
+    if (index < 0)
+    {
+        /* find product to remove's quality (O(logn)) */
+        productToDelete = searchTime(ds->timeRoot, time);
+        if (productToDelete == NULL || productToDelete->time != time || !productWeight(productToDelete)) return;   /* product not found */
+    }
+    writeBegin(ds);
 
-    /* remove from Time tree (O(logn)) */
-    newTimeRoot = removeProductFromTime(ds->timeRoot, time);
-    ds->timeRoot = newTimeRoot;
+    if (index >= 0)
+    {
+        quality = ds->bufferQuality[index];
+        bufferRemoveAt(ds, index);
+    }
+    else
+    {
+        quality = productToDelete->quality;                                 /* get products quality */
 
-    /* remove from Quality tree (O(logn)) */
-    newQualityRoot = removeProductFromQuality(ds->qualityRoot, time, quality);
-    ds->qualityRoot = newQualityRoot;
+#ifdef LAZY_DELETE
+        /* mark product and its twin as tombstones, no rotations (O(logn)) */
+        tombstoneProduct(ds, productToDelete);
+#else
+        /* remove from Time tree (O(logn)) */
+        newTimeRoot = removeProductFromTime(ds->pool, ds->timeRoot, time);
+        ds->timeRoot = newTimeRoot;
 
-    /* check if special quality exists (O(logn)) */
+        /* remove from Quality tree (O(logn)) */
+        newQualityRoot = removeProductFromQuality(ds->pool, ds->qualityRoot, time, quality);
+        ds->qualityRoot = newQualityRoot;
+#endif
+#ifdef BUCKET_TIME_INDEX
+        ds->bucketRoot = bucketRemove(ds->bucketRoot, time);
+#endif
+#ifdef DOMINANCE_INDEX
+        ds->dominanceRoot = dominanceRemove(ds->dominanceRoot, time, quality, &ds->dominanceRemoved);
+#endif
+    }
+#ifdef QUALITY_SKETCH
+    sketchAdd(ds, time, quality, -1);
+#endif
+
+    /* check if special quality exists in trees or in write buffer (O(logn + capacity)) */
     if (quality == ds->special)
     {
         qualitySearch = searchQuality(ds->qualityRoot, quality);
-        if (qualitySearch == NULL || qualitySearch->quality != quality) ds->specialExists = 0;
+        if ((qualitySearch == NULL || qualitySearch->quality != quality || timeSubtreeSize(qualitySearch) == 0) &&
+            !bufferHasQuality(ds, quality)) ds->specialExists = 0;
     }
+#ifdef LAZY_DELETE
+    if (tombstonesDue(ds)) PurgeTombstones(ds);     /* amortized O(1) */
+#endif
+    writeEnd(ds);
 }
 
 /* FUNCTION 4 - removes all products with specific quality O((klogn)) */
-void RemoveQuality(DataStructure* ds, int quality)
+void RemoveQuality(DataStructure* ds, QualityType quality)
 {
-    Product *qualityNode, *newTimeRoot, *newQualityRoot;
-    int qualityExists, currentTime;
+    Product *qualityNode;
+#ifndef LAZY_DELETE
+    Product *newTimeRoot, *newQualityRoot;
+#endif
+    TimeType currentTime;
+    int qualityExists, index;
+
+    writeBegin(ds);
 
     /* check if special quality */
     if (ds->special == quality) ds->specialExists = 0;
 
+    /* remove products with quality from write buffer (O(capacity)) */
+    for (index = 0; index < ds->bufferSize; )
+    {
+        if (ds->bufferQuality[index] != quality) index++;
+        else
+        {
+#ifdef QUALITY_SKETCH
+            sketchAdd(ds, ds->bufferTime[index], quality, -1);
+#endif
+            bufferRemoveAt(ds, index);
+        }
+    }
+
     /* search for quality node (O(logn)) */
     qualityNode = searchQuality(ds->qualityRoot, quality);
-    if (qualityNode == NULL || qualityNode->quality != quality) return; /* product not found */
-    else qualityExists = 1;
+    qualityExists = (qualityNode != NULL && qualityNode->quality == quality && timeSubtreeSize(qualityNode) > 0);
 
     /* delete all products with quality from both trees (O(klogn)) */
     while (qualityExists) /* k times */
     {
+#ifdef LAZY_DELETE
+        /* mark first live product of quality and its twin as tombstones (O(logn)) */
+        currentTime = qualityNode->timeSubtree->minQualityP->time;
+        tombstoneProduct(ds, searchTime(ds->timeRoot, currentTime));
+#else
         currentTime = qualityNode->timeSubtree->time; /* find subtimeRoot time */
 
         /* remove from Time tree (O(logn)) */
-        newTimeRoot = removeProductFromTime(ds->timeRoot, currentTime);
+        newTimeRoot = removeProductFromTime(ds->pool, ds->timeRoot, currentTime);
         ds->timeRoot = newTimeRoot;
 
         /* remove from Quality tree (O(logn)) */
-        newQualityRoot = removeProductFromQuality(ds->qualityRoot, currentTime, quality);
+        newQualityRoot = removeProductFromQuality(ds->pool, ds->qualityRoot, currentTime, quality);
         ds->qualityRoot = newQualityRoot;
+#endif
+#ifdef BUCKET_TIME_INDEX
+        ds->bucketRoot = bucketRemove(ds->bucketRoot, currentTime);
+#endif
+#ifdef DOMINANCE_INDEX
+        ds->dominanceRoot = dominanceRemove(ds->dominanceRoot, currentTime, quality, &ds->dominanceRemoved);
+#endif
+#ifdef QUALITY_SKETCH
+        sketchAdd(ds, currentTime, quality, -1);
+#endif
 
         /* check if quality still exits (O(logn)) */
         qualityNode = searchQuality(ds->qualityRoot, quality);
-        if (qualityNode == NULL || qualityNode->quality != quality) qualityExists = 0;
+        if (qualityNode == NULL || qualityNode->quality != quality || timeSubtreeSize(qualityNode) == 0) qualityExists = 0;
+    }
+#ifdef LAZY_DELETE
+    if (tombstonesDue(ds)) PurgeTombstones(ds);     /* amortized O(1) per product */
+#endif
+    writeEnd(ds);
+}
+
+/* FUNCTION 5 - returns the i-th rank product's time, -1 if it doesnt exist */
+TimeType GetIthRankProduct(DataStructure ds, int i)
+{
+    TimeType ithTime;
+    if (!FindIthRankProduct(ds, i, &ithTime)) return (TimeType)-1;
+    return ithTime;
+}
+
+/* FUNCTION 6 - returns the i-th rank product's time between t1 and t2, -1 if it doesnt exist */
+TimeType GetIthRankProductBetween(DataStructure ds, TimeType time1, TimeType time2, int i)
+{
+    TimeType ithTime;
+    if (!FindIthRankProductBetween(ds, time1, time2, i, &ithTime)) return (TimeType)-1;
+    return ithTime;
+}
+
+/* FUNCTION 7 - returns 1 if a product with special quality exists, 0 otherwise (O(1)) */
+int Exists(DataStructure ds)
+{
+    return ds.specialExists;
+}
+
+/* FUNCTION 8 - initiallize data structure with a write buffer of capacity products and return it */
+DataStructure InitBuffered(QualityType s, int capacity)
+{
+    DataStructure newDS = Init(s);
+    if (capacity <= 0) return newDS;
+
+    newDS.bufferTime = (TimeType*)malloc(capacity * sizeof(TimeType));
+    newDS.bufferQuality = (QualityType*)malloc(capacity * sizeof(QualityType));
+#ifdef PRODUCT_PAYLOAD_TYPE
+    newDS.bufferPayload = (PayloadType*)malloc(capacity * sizeof(PayloadType));
+    if (newDS.bufferPayload == NULL)
+    {
+        free(newDS.bufferTime);
+        newDS.bufferTime = NULL;
     }
+#endif
+    if (newDS.bufferTime == NULL || newDS.bufferQuality == NULL)
+    {
+        /* fall back to unbuffered data structure */
+        free(newDS.bufferTime);
+        free(newDS.bufferQuality);
+        newDS.bufferTime = NULL;
+        newDS.bufferQuality = NULL;
+        return newDS;
+    }
+    newDS.bufferCapacity = capacity;
+    return newDS;
+}
+
+/* FUNCTION 9 - merges the write buffer into time tree and quality tree in one batch (O(klogn)) */
+void FlushBuffer(DataStructure* ds)
+{
+    writeBegin(ds);
+    drainBuffer(ds, ds->bufferSize);
+    ds->bufferDraining = 0;
+    writeEnd(ds);
 }
 
-/* FUNCTION 5 - returns the i-th rank product's time */
-int GetIthRankProduct(DataStructure ds, int i)
+/* FUNCTION 10 - finds the i-th rank product's time, returns 1 if found, 0 otherwise (O(capacity * logn)) */
+int FindIthRankProduct(DataStructure ds, int i, TimeType* time)
 {
     Product *ithProduct;
-    /* empty tree */
-    if (ds.qualityRoot == NULL) return -1;
+    int j, rank;
+
+    /* input check */
+    if (i < 1) return 0;
+
+    /* merge write buffer products with the quality tree by rank (O(capacity * logn)) */
+    for (j = 0; j < ds.bufferSize; j++)
+    {
+        /* rank of buffer product j among all products */
+        rank = countSmallerProducts(ds.qualityRoot, ds.bufferTime[j], ds.bufferQuality[j]) + j + 1;
+        if (rank == i)
+        {
+            *time = ds.bufferTime[j];
+            return 1;
+        }
+        if (rank > i) break;    /* ith product is in the tree, after j buffer products */
+    }
 
     /* find the ith rank product (O(logn)) */
-    ithProduct = findIthQuality(ds.qualityRoot, i);
+    ithProduct = findIthQuality(ds.qualityRoot, i - j);
 
-    if (ithProduct == NULL) return -1;      /* if doesnt exist */
-    else return ithProduct->time;
+    if (ithProduct == NULL) return 0;       /* if doesnt exist */
+    *time = ithProduct->time;
+    return 1;
 }
 
-/* FUNCTION 6 - returns the i-th rank product's time between t1 and t2*/
-int GetIthRankProductBetween(DataStructure ds, int time1, int time2, int i)
+/* FUNCTION 11 - finds the i-th rank product's time between t1 and t2, returns 1 if found, 0 otherwise (O(ilogn)) */
+int FindIthRankProductBetween(DataStructure ds, TimeType time1, TimeType time2, int i, TimeType* time)
 {
-    Product *minProduct;
-    int left, right, ithTime, counter, maxQuality, j;
-    int *minTime, *minQuality;
+    RangeHeap heap;
+    TimeType left, right, current, treeTime;
+    QualityType treeQuality;
+    int found, treeFound, j, k;
 
     /* update bounds */
     left = min(time1, time2);
     right = max(time1, time2);
-    left = findTimeOrSuccessor(ds.timeRoot, left)->time;
-    right = findTimeOrPredecessor(ds.timeRoot, right)->time;
-
-    counter = countProducts(ds.timeRoot, left, right);  /* count how many products are between time1 and time2 */
 
     /* input check */
-    if (ds.timeRoot == NULL) return -1;                                    /* empty ds */
-    if (i < 1 || i > ds.timeRoot->subtreeSize || i > counter) return -1;   /* i range check */
+    if (i < 1 || i > CountBetween(ds, left, right)) return 0;    /* i range check */
 
-    /* array for time of minimum products */
-    minTime = (int*)malloc(i * sizeof(int));
-    if (minTime == NULL) return -1;
+    /* first write buffer product between t1 and t2 (buffer is sorted by quality) */
+    k = 0;
+    while (k < ds.bufferSize && (ds.bufferTime[k] < left || ds.bufferTime[k] > right)) k++;
 
-    /* array for quality of minimum products */
-    minQuality = (int*)malloc(i * sizeof(int));
-    if (minQuality == NULL) return -1;
-
-    for (j = 0; j < i; j++)        /* i times */
+    /* best product - minimum quality in range, no heap needed (O(logn)) */
+    if (i == 1)
     {
-        /* find the minimum quality node between t1 and t2 (O(logn)) */
-        minProduct = findMinQualityBetween(ds.timeRoot, left, right);
+        treeFound = rangeMin(&ds, left, right, &treeTime, &treeQuality);
+        if (!treeFound || (k < ds.bufferSize &&
+            compareProducts(ds.bufferTime[k], ds.bufferQuality[k], treeTime, treeQuality) < 0))
+        {
+            *time = ds.bufferTime[k];
+        }
+        else *time = treeTime;
+        return 1;
+    }
 
-        /* find maximum quality that exists and add EXTRA */
-        maxQuality = maxProduct(ds.qualityRoot)->quality + EXTRA;
+    /* split time range to O(logn) pieces, ordered by their minimum quality product */
+    rangeHeapInit(&heap, &ds, left, right);
+    treeFound = rangeHeapNext(&heap, &treeTime, &treeQuality);
 
-        /* add current minimum to arrays */
-        minTime[j] = minProduct->time;
-        minQuality[j] = minProduct->quality;
+    found = 0;
+    for (j = 1; j <= i; j++)        /* i times */
+    {
+        /* next write buffer product between t1 and t2 (buffer is sorted by quality) */
+        while (k < ds.bufferSize && (ds.bufferTime[k] < left || ds.bufferTime[k] > right)) k++;
 
-        /* update minimum quality to max */
-        ds.timeRoot = updateToNewQuality(ds.timeRoot, minProduct->time, maxQuality);
+        /* write buffer product is smaller */
+        if (k < ds.bufferSize && (!treeFound ||
+            compareProducts(ds.bufferTime[k], ds.bufferQuality[k], treeTime, treeQuality) < 0))
+        {
+            current = ds.bufferTime[k++];
+        }
+        /* tree product is smaller - take the next one from the heap (O(logn)) */
+        else if (treeFound)
+        {
+            current = treeTime;
+            treeFound = rangeHeapNext(&heap, &treeTime, &treeQuality);
+        }
+        else break;     /* heap allocation failed */
 
-        /* update bounds */
-        if (j != i-1)
+        if (j == i)
         {
-            left = findTimeOrSuccessor(ds.timeRoot, left)->time;
-            right = findTimeOrPredecessor(ds.timeRoot, right)->time;
+            *time = current;
+            found = 1;
         }
     }
+    free(heap.entries);
+    return found;
+}
 
-    /* keep return value */
-    ithTime = minTime[i-1];
+#ifdef PRODUCT_PAYLOAD_TYPE
 
-    /* update products quality back to original */
-    for (j = 0; j < i; j++)
-    {
-        ds.timeRoot = updateToNewQuality(ds.timeRoot, minTime[j], minQuality[j]);
-    }
-    free(minTime);
-    free(minQuality);
-    return ithTime;
+/* FUNCTION 12 - adds a product with a payload, returns 1 if added, 0 if the allocator is full (O(logn)) */
+int AddProductWithPayload(DataStructure* ds, TimeType time, QualityType quality, PayloadType payload)
+{
+    Product *x;
+    int index;
+
+    if (!AddProduct(ds, time, quality)) return 0;
+    writeBegin(ds);
+
+    /* product is in write buffer or was flushed to the trees */
+    index = bufferFindTime(ds, time);
+    x = searchTime(ds->timeRoot, time);
+    if (index >= 0) ds->bufferPayload[index] = payload;
+    else if (x != NULL && x->time == time) x->payload = payload;
+    writeEnd(ds);
+    return 1;
 }
 
-/* FUNCTION 7 - returns 1 if a product with special quality exists, 0 otherwise (O(1)) */
-int Exists(DataStructure ds)
+/* FUNCTION 13 - gets payload of product by time, returns 1 if found, 0 otherwise (O(logn)) */
+int GetProductPayload(DataStructure ds, TimeType time, PayloadType* payload)
 {
-    return ds.specialExists;
-}
+    Product *x;
+    int index;
 
-/*--------------- HELPER FUNCTIONS ----------------*/
+    /* product is still in write buffer */
+    index = bufferFindTime(&ds, time);
+    if (index >= 0)
+    {
+        *payload = ds.bufferPayload[index];
+        return 1;
+    }
 
-/* creates a new Product and returns it (O(1))*/
-Product* creatNewProduct(int newTime, int newQuality)
-{
-    /* allocate memory for new product */
-    Product* newProduct = (Product*)malloc(sizeof(Product));
-    if (newProduct == NULL) return NULL;
-    newProduct->quality = newQuality;
-    newProduct->time = newTime;
-    newProduct->left = NULL;
-    newProduct->right = NULL;
-    newProduct->parent = NULL;
-    newProduct->timeSubtree = NULL;
-    newProduct->minQualityP = newProduct;
-    newProduct->height = 0;
-    newProduct->subtreeSize = 1;
-    newProduct->minQuality = newQuality;
-    return newProduct;
+    x = searchTime(ds.timeRoot, time);
+    if (x == NULL || x->time != time || !productWeight(x)) return 0;     /* product not found */
+    *payload = x->payload;
+    return 1;
 }
 
-/* creates a new quality node and returns it (O(1))*/
-Product* createQualityNode(int newQuality)
-{
-    /* allocate memory for new quality node */
-    Product *newQualityNode = (Product*)malloc(sizeof(Product));
-    if (newQualityNode == NULL) return NULL;
-    newQualityNode->quality = newQuality;
-    newQualityNode->time = -1;                  /* irrelevent for this type of node */
-    newQualityNode->left = NULL;
-    newQualityNode->right = NULL;
-    newQualityNode->parent = NULL;
-    newQualityNode->timeSubtree = NULL;
-    newQualityNode->minQualityP = NULL;         /* irrelevent for this type of node */
-    newQualityNode->height = 0;
-    newQualityNode->subtreeSize = 0;
-    newQualityNode->minQuality = newQuality;    /* irrelevent for this type of node */
-    return newQualityNode;
-}
+#endif
 
-/* swaps between two products (O(1)) */
-void swapProduct(Product* a, Product* b)
+/* FUNCTION 14 - moves all products of src into dst, keeping dst's product on equal times, returns 1 if merged, 0 otherwise (O(mlog(n/m + 1))) */
+int Merge(DataStructure* dst, DataStructure* src)
 {
-    Product* temp;
+    Product *dropped, *next, *qualityNode;
+
+    /* a data structure can't be merged into itself, the union would free its own products */
+    if (dst == src) return 0;
+    /* products can only move between data structures with the same allocator */
+    if (dst->pool != src->pool) return 0;
+    writeBegin(src);
+    writeBegin(dst);
+
+    /* merge through the trees only */
+    if (dst->bufferSize > 0) FlushBuffer(dst);
+    if (src->bufferSize > 0) FlushBuffer(src);
+
+#ifdef LAZY_DELETE
+    /* union works on live products only, nothing is merged if a rebuild fails (O(n + m) with tombstones) */
+    if (!PurgeTombstones(dst) || !PurgeTombstones(src))
+    {
+        writeEnd(dst);
+        writeEnd(src);
+        return 0;
+    }
+#endif
+
+#ifdef BUCKET_TIME_INDEX
+    /* insert src products to dst bucket index, times already in dst are skipped (O(mlogn)) */
+    dst->bucketRoot = bucketMerge(dst->bucketRoot, src->bucketRoot);
+    src->bucketRoot = NULL;
+#endif
+#ifdef DOMINANCE_INDEX
+    /* insert src products to dst dominance index, times already in dst are skipped (O(mlog^2n)) */
+    dst->dominanceRoot = dominanceMerge(dst->dominanceRoot, dst->timeRoot, src->timeRoot, &dst->dominanceRemoved);
+    freeDominance(src->dominanceRoot);
+    src->dominanceRoot = NULL;
+    src->dominanceRemoved = 0;
+#endif
+#ifdef QUALITY_SKETCH
+    /* src's histograms are added to dst's, dropped products are taken out below (O(buckets * bins)) */
+    sketchMerge(dst, src);
+#endif
+
+#ifdef ONLINE_COMPACTION
+    /* src's compaction blocks move with its products, its pass is dropped */
+    compactClose(src);
+    src->compactPhase = 0;
+#endif
+
+    /* union time trees, src products with times already in dst are dropped */
+    dropped = NULL;
+    dst->timeRoot = unionTimes(dst->timeRoot, src->timeRoot, &dropped, 0);
+
+    /* remove dropped products' twins from src quality tree (O(logm) each) */
+    for (; dropped != NULL; dropped = next)
+    {
+        next = dropped->parent;
+        src->qualityRoot = removeProductFromQuality(src->pool, src->qualityRoot, dropped->time, dropped->quality);
+#ifdef QUALITY_SKETCH
+        sketchAdd(dst, dropped->time, dropped->quality, -1);
+#endif
+        freeProduct(src->pool, dropped);
+    }
 
-    /* update time and quality */
-    a->time = b->time;
-    a->quality = b->quality;
+    /* union quality trees, matching qualities union their time subtrees and src's node is dropped */
+    dst->qualityRoot = unionQualities(dst->qualityRoot, src->qualityRoot, &dropped, 0);
+    for (; dropped != NULL; dropped = next)
+    {
+        next = dropped->parent;
+        freeProduct(src->pool, dropped);
+    }
 
-    /* swap time subtree */
-    temp = a->timeSubtree;
-    a->timeSubtree = b->timeSubtree;
-    b->timeSubtree = temp;
+    /* check if special quality exists (O(logn)) */
+    qualityNode = searchQuality(dst->qualityRoot, dst->special);
+    dst->specialExists = (qualityNode != NULL && qualityNode->quality == dst->special);
+
+    /* src is left empty */
+    src->timeRoot = NULL;
+    src->qualityRoot = NULL;
+    src->specialExists = 0;
+    writeEnd(dst);
+    writeEnd(src);
+    return 1;
 }
 
-/* search a product in time tree and returns a pointer to found product / its successor or predeccessor (O(logn)) */
-Product* searchTime(Product* root, int time)
+/* FUNCTION 15 - reader side of seqlock, waits for a write in progress and returns version to pass to ReadRetry */
+unsigned long ReadBegin(DataStructure* ds)
 {
-    Product *y = NULL;
-    Product *z = root;
-    while (z != NULL)
-    {
-        y = z;
-        if (time == z->time) return z;
-        if (time < z->time) z = z->left;
-        else z = z->right;
-    }
-    return y;
+    unsigned long version;
+    while ((version = __atomic_load_n(&ds->version, __ATOMIC_ACQUIRE)) & 1);
+#ifdef SHARED_MEMORY
+    readStructure = ds;
+    readVersion = version;
+    readSteps = 0;
+    readTorn = 0;
+#endif
+    return version;
 }
 
-/* search a product in quality tree and return a pointer to found node / its successor or predecessor (O(logn)) */
-Product* searchQuality(Product* root, int quality)
+/* FUNCTION 16 - returns 1 if the writer changed the data structure since ReadBegin, so the query should be repeated */
+int ReadRetry(DataStructure* ds, unsigned long version)
 {
-    Product *y = NULL;
-    Product *z = root;
-    while (z != NULL)
-    {
-        y = z;
-        if (quality == z->quality) return z;
-        if (quality < z->quality) z = z->left;
-        else z = z->right;
-    }
-    return y;
+#ifdef SHARED_MEMORY
+    readStructure = NULL;
+#endif
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&ds->version, __ATOMIC_RELAXED) != version);
 }
 
-/* returns a nodes height (O(1)) */
-int height(Product* x)
+/* FUNCTION 20 - returns how many products are between time1 and time2 (O(logn + capacity)) */
+int CountBetween(DataStructure ds, TimeType time1, TimeType time2)
 {
-    int leftHeight, rightHeight;
+    TimeType left, right;
+    int counter, k;
 
-    /* if product is NULL, height is -1 */
-    if (x == NULL) return -1;
+    /* update bounds */
+    left = min(time1, time2);
+    right = max(time1, time2);
 
-    /* get the height of the subtrees and return the max height + 1*/
-    leftHeight = (x->left ? x->left->height : -1);
-    rightHeight = (x->right ? x->right->height : -1);
-    return (max(leftHeight, rightHeight) + 1);
-}
+    counter = rangeCount(&ds, left, right);
 
-/* gets a product and updates its height (O(1)) */
-void updateHeight(Product* x)
-{
-    x->height = height(x);
+    /* count write buffer products between time1 and time2 */
+    for (k = 0; k < ds.bufferSize; k++)
+    {
+        if (ds.bufferTime[k] >= left && ds.bufferTime[k] <= right) counter++;
+    }
+    return counter;
 }
 
-/* gets two products and returns the smaller product by quality & time (O(1)) */
-Product* minOfTwoProducts(Product* x, Product* y)
+/* FUNCTION 34 - returns how many products have time between time1 and time2 and quality between quality1 and quality2.
+   O(klogn + capacity) for k qualities up to the bigger quality, O(log^2n + capacity) with DOMINANCE_INDEX */
+int CountInBox(DataStructure ds, TimeType time1, TimeType time2, QualityType quality1, QualityType quality2)
 {
-    if (x == NULL) return y;
-    if (y == NULL) return x;
+    TimeType left, right;
+    QualityType low, high;
 
-    /* compare by quality */
-    if (x->quality < y->quality) return x;
-    if (x->quality > y->quality) return y;
+    /* update bounds */
+    left = min(time1, time2);
+    right = max(time1, time2);
+    low = min(quality1, quality2);
+    high = max(quality1, quality2);
 
-    /* compare by time */
-    if (x->quality == y->quality) return (x->time < y->time ? x : y);
+    /* products up to high quality minus products below low quality */
+    return boxCount(&ds, left, right, high, 1) - boxCount(&ds, left, right, low, 0) +
+           bufferBoxCount(&ds, left, right, high, 1) - bufferBoxCount(&ds, left, right, low, 0);
 }
 
-/* returns the minimum quality product of two nodes - for delete (O(1)) */
-Product* minQualityPointer(Product* x, Product* y)
+/* FUNCTION 35 - finds the q-quantile (0 to 1) quality of products between t1 and t2, returns 1 if found, 0 otherwise.
+   O(k * logk * logn + capacity * klogn) for k qualities, O(log^3n + capacity * log^2n) with DOMINANCE_INDEX */
+int QualityQuantileBetween(DataStructure ds, TimeType time1, TimeType time2, double q, QualityType* quality)
 {
-    if (x == NULL || y == NULL) return NULL;
+    Product *x;
+    TimeType left, right;
+    int counter, rank, found, k;
 
-    /* if we deleted the minimum quality */
-    if (x->minQualityP == NULL && y->minQualityP) return minOfTwoProducts(x, y->minQualityP);
-    if (x->minQualityP && y->minQualityP == NULL) return minOfTwoProducts(x->minQualityP, y);
+    /* update bounds */
+    left = min(time1, time2);
+    right = max(time1, time2);
+
+    /* rank of quantile product by quality */
+    counter = CountBetween(ds, left, right);
+    if (counter == 0 || q < 0 || q > 1) return 0;
+    rank = (int)(q * counter);
+    if (rank < q * counter) rank++;       /* round up */
+    rank = max(rank, 1);
 
-    /* both pointing to NULL */
-    if (y->minQualityP == NULL && x->minQualityP == NULL) return minOfTwoProducts(x, y);
+    /* smallest tree quality with at least rank products up to it (O(log^3n)) */
+    found = 0;
+    for (x = ds.qualityRoot; x != NULL && READ_STEP(); )
+    {
+        if (boxCount(&ds, left, right, x->quality, 1) + bufferBoxCount(&ds, left, right, x->quality, 1) >= rank)
+        {
+            *quality = x->quality;
+            found = 1;
+            x = x->left;
+        }
+        else x = x->right;
+    }
 
-    /* if both still pointing to the minimum */
-    else return minOfTwoProducts(x->minQualityP, y->minQualityP);
+    /* a smaller write buffer quality may reach rank first (buffer is sorted by quality) */
+    for (k = 0; k < ds.bufferSize && (!found || ds.bufferQuality[k] < *quality); k++)
+    {
+        if (ds.bufferTime[k] < left || ds.bufferTime[k] > right) continue;
+        if (boxCount(&ds, left, right, ds.bufferQuality[k], 1) + bufferBoxCount(&ds, left, right, ds.bufferQuality[k], 1) >= rank)
+        {
+            *quality = ds.bufferQuality[k];
+            return 1;
+        }
+    }
+    return found;
 }
 
-/* updating minimum quality pointer (O(1)) */
-void updateMinQuality(Product* x)
+#ifdef ONLINE_COMPACTION
+
+/* FUNCTION 36 - moves up to budget products to contiguous blocks, time tree in time order then quality tree in quality order,
+   adds to report if not NULL, returns 1 when a compaction pass ends (O(budget + logn)) */
+int CompactStep(DataStructure* ds, int budget, CompactionReport* report)
 {
-    Product* temp;
-    if (x == NULL) return;
+    Product *x, *q;
+    int finished = 0;
 
-    /* no subtree - x is the minimum */
-    if (x->left == NULL && x->right == NULL)
+    writeBegin(ds);
+    if (ds->compactPhase == 0)
+    {
+        ds->compactPhase = 1;
+        ds->compactStep = 0;
+    }
+
+    /* time tree, resumed after last moved time */
+    if (ds->compactPhase == 1)
     {
-        x->minQualityP = x;
-        x->minQuality = x->quality;
+        x = (ds->compactStep == 0 ? minProduct(ds->timeRoot) : timeAfter(ds->timeRoot, ds->compactTime));
+        for (; x != NULL && budget > 0; budget--)
+        {
+            x = relocateProduct(ds, x, &ds->timeRoot, ds->timeRoot->subtreeSize, report);
+            ds->compactTime = x->time;
+            ds->compactStep = 1;
+            x = successorProduct(x);
+        }
+        if (x == NULL)      /* time tree done, quality tree goes to a new block */
+        {
+            compactClose(ds);
+            ds->compactPhase = 2;
+            ds->compactStep = 0;
+        }
     }
-    /* if x has both children */
-    if (x->right && x->left)
+
+    /* quality tree, every quality node followed by its time subtree */
+    while (ds->compactPhase == 2 && budget > 0)
     {
-        /* comparing the children, then comparing minimum child with parent */
-        temp = minQualityPointer(x->right, x->left);
-        x->minQualityP = minQualityPointer(x, temp);
-        x->minQuality = x->minQualityP->quality;
+        /* current quality node, or next one when it is done or was removed */
+        q = (ds->compactStep == 0 ? minProduct(ds->qualityRoot) : qualityAfter(ds->qualityRoot, ds->compactQuality, ds->compactStep != 3));
+        if (q == NULL)
+        {
+            finished = 1;
+            break;
+        }
+        if (ds->compactStep == 0 || ds->compactStep == 3 || q->quality != ds->compactQuality)
+        {
+            q = relocateProduct(ds, q, &ds->qualityRoot, ds->qualityRoot->subtreeSize, report);
+            ds->compactQuality = q->quality;
+            ds->compactStep = 1;
+            budget--;
+            continue;
+        }
+        x = (ds->compactStep == 1 ? minProduct(q->timeSubtree) : timeAfter(q->timeSubtree, ds->compactTime));
+        for (; x != NULL && budget > 0; budget--)
+        {
+            x = relocateProduct(ds, x, &q->timeSubtree, ds->qualityRoot->subtreeSize, report);
+            ds->compactTime = x->time;
+            ds->compactStep = 2;
+            x = successorProduct(x);
+        }
+        if (x == NULL) ds->compactStep = 3;
     }
-    /* if x has only one child */
-    else if (x->left || x->right)
+
+    /* pass ended */
+    if (finished)
     {
-        temp = (x->right ? x->right : x->left);
-        x->minQualityP = minQualityPointer(x, temp);
-        x->minQuality = x->minQualityP->quality;
+        compactClose(ds);
+        ds->compactPhase = 0;
+        ds->compactStep = 0;
     }
+    writeEnd(ds);
+    return finished;
 }
 
-/* right rotation (O(1)) */
-Product* rightRotate(Product* x)
+/* FUNCTION 37 - returns nanoseconds per product of in order traversals of time tree and of quality tree with its time subtrees (O(n)) */
+double TraversalTime(DataStructure ds)
 {
-    /* update left and right pointers */
-    Product* y = x->left;
-    x->left = y->right;
-    y->right = x;
-
-    /* update parents */
-    if (x->parent)
+    struct timespec start, end;
+    Product *x, *q;
+    TimeType sum = 0;
+    long visited = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (x = minProduct(ds.timeRoot); x != NULL; x = successorProduct(x), visited++) sum += x->time;
+    for (q = minProduct(ds.qualityRoot); q != NULL; q = successorProduct(q))
     {
-        /* if x is a left child */
-        if (x->parent->left == x) x->parent->left = y;
-        /* if x is a right child */
-        if (x->parent->right == x) x->parent->right = y;
+        for (x = minProduct(q->timeSubtree); x != NULL; x = successorProduct(x), visited++) sum += x->time;
     }
-    y->parent = x->parent;
-    x->parent = y;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    traversalChecksum += sum;
 
-    /* update heights */
-    updateHeight(x);
-    updateHeight(y);
+    if (visited == 0) return 0;
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / visited;
+}
 
-    /* update subtree size */
-    if (x->left) x->subtreeSize = x->subtreeSize - y->subtreeSize + x->left->subtreeSize ;
-    else x->subtreeSize = x->subtreeSize - y->subtreeSize;
+#endif
 
-    if (x->right) y->subtreeSize = y->subtreeSize + x->right->subtreeSize + 1;
-    else y->subtreeSize++;
+#ifdef QUALITY_SKETCH
 
-    /* update min quality in subtree */
-    updateMinQuality(y);
-    updateMinQuality(x);
+/* FUNCTION 38 - returns approximate q-quantile (0 to 1) quality of products between t1 and t2 from the time buckets' sketches,
+   the quality's bin holds ranks within err of the quantile's rank, err is -1 and 0 is returned if there are no products
+   or the sketches lost products to a failed allocation (O(buckets * bins + logn + capacity)) */
+QualityType ApproxQualityQuantile(DataStructure ds, TimeType time1, TimeType time2, double q, int* err)
+{
+    TimeType left, right, first, last;
+    int *merged, n, outside, rank, lowBin, highBin, lo, hi, j, k;
 
-    return y;
+    /* update bounds */
+    left = min(time1, time2);
+    right = max(time1, time2);
+
+    *err = -1;
+    n = CountBetween(ds, left, right);
+    if (n == 0 || q < 0 || q > 1) return 0;
+
+    /* sketches of buckets overlapping range */
+    first = timeBucket(left);
+    last = timeBucket(right);
+    lo = sketchIndex(&ds, first);
+    for (hi = lo; hi < ds.sketchCount && ds.sketches[hi].bucket <= last; hi++);
+    while (lo < hi && ds.sketches[lo].size == 0) lo++;      /* sketch whose first bin failed to allocate */
+    if (lo == hi) return 0;
+
+    /* products of first and last buckets outside range are counted too (O(logn + capacity)) */
+    outside = 0;
+    if (left > first * SKETCH_WIDTH) outside += CountBetween(ds, first * SKETCH_WIDTH, left - 1);
+    if (right < last * SKETCH_WIDTH + (SKETCH_WIDTH - 1)) outside += CountBetween(ds, right + 1, last * SKETCH_WIDTH + (SKETCH_WIDTH - 1));
+
+    /* merge bin counts */
+    lowBin = ds.sketches[lo].bins[0];
+    highBin = ds.sketches[lo].bins[ds.sketches[lo].size - 1];
+    for (j = lo + 1; j < hi; j++)
+    {
+        if (ds.sketches[j].size == 0) continue;
+        lowBin = min(lowBin, ds.sketches[j].bins[0]);
+        highBin = max(highBin, ds.sketches[j].bins[ds.sketches[j].size - 1]);
+    }
+    merged = (int*)calloc(highBin - lowBin + 1, sizeof(int));
+    if (merged == NULL) return 0;
+    for (j = lo; j < hi; j++)
+    {
+        for (k = 0; k < ds.sketches[j].size; k++) merged[ds.sketches[j].bins[k] - lowBin] += ds.sketches[j].counts[k];
+    }
+
+    /* rank in range, moved to the middle of the outside products' uncertainty */
+    rank = (int)(q * n);
+    if (rank < q * n) rank++;       /* round up */
+    rank = max(rank, 1) + outside / 2;
+
+    /* bin holding rank, none if the sketches hold fewer products than the trees */
+    for (k = 0; k <= highBin - lowBin && rank > merged[k]; k++) rank -= merged[k];
+    free(merged);
+    if (k > highBin - lowBin) return 0;
+    *err = (outside + 1) / 2;
+    return binQuality(k + lowBin);
 }
 
-/* left rotation (O(1)) */
-Product* leftRotate(Product* x)
+#endif
+
+#ifdef LAZY_DELETE
+
+/* FUNCTION 39 - frees all tombstones and rebuilds both trees balanced from their live products,
+   returns 0 if allocation failed and tombstones were kept, 1 otherwise (O(n)) */
+int PurgeTombstones(DataStructure* ds)
 {
-    /* update left and right pointers */
-    Product* y = x->right;
-    x->right = y->left;
-    y->left = x;
+    Product **nodes, **qualities;
+    int live, count;
+
+    if (ds->tombstones == 0) return 1;
+
+    /* live products of a time subtree, and non empty quality nodes */
+    live = ds->timeRoot->subtreeSize;
+    nodes = (Product**)malloc(2 * (live + 1) * sizeof(Product*));
+    if (nodes == NULL) return 0;
+    qualities = nodes + live + 1;
+    writeBegin(ds);
+
+    /* time tree */
+    count = collectLive(ds->pool, ds->timeRoot, nodes, 0);
+    ds->timeRoot = buildBalanced(nodes, 0, count - 1);
+
+    /* time subtrees of quality tree, then quality tree without its emptied quality nodes */
+    count = purgeQualities(ds->pool, ds->qualityRoot, qualities, 0, nodes);
+    ds->qualityRoot = buildBalanced(qualities, 0, count - 1);
+
+    ds->tombstones = 0;
+    writeEnd(ds);
+    free(nodes);
+    return 1;
+}
 
-    /* update parent */
-    if (x->parent)
+#endif
+
+/* FUNCTION 21 - initiallize data structure keeping up to threshold products in arrays, then in trees */
+DataStructure InitSmall(QualityType s, int threshold)
+{
+    DataStructure newDS = InitBuffered(s, threshold);
+    newDS.smallInstance = (newDS.bufferCapacity > 0);
+    return newDS;
+}
+
+/* FUNCTION 22 - initiallize an empty tenant manager, tenants keep up to smallThreshold products in arrays */
+TenantManager InitManager(int smallThreshold)
+{
+    TenantManager manager;
+    size_t arraySize;
+
+    manager.tenants = NULL;
+    manager.instances = NULL;
+    manager.capacity = 0;
+    manager.count = 0;
+    manager.smallThreshold = max(smallThreshold, 0);
+
+    /* one array item fits the times, qualities or payloads of a small tenant */
+    arraySize = max(sizeof(TimeType), sizeof(QualityType));
+#ifdef PRODUCT_PAYLOAD_TYPE
+    arraySize = max(arraySize, sizeof(PayloadType));
+#endif
+    manager.products = initPool(sizeof(Product), 4096);
+    manager.arrays = initPool(max(manager.smallThreshold, 1) * arraySize, 1024);
+    manager.structures = initPool(sizeof(DataStructure), 1024);
+    return manager;
+}
+
+/* FUNCTION 23 - adds a tenant with special quality s and returns its data structure, existing tenants are returned as is (O(1)) */
+DataStructure* AddTenant(TenantManager* manager, long tenant, QualityType s)
+{
+    DataStructure* ds;
+    int slot, allocated;
+
+    /* keep hash table at most half full */
+    if (2 * (manager->count + 1) > manager->capacity && !growTenants(manager)) return NULL;
+
+    slot = tenantSlot(manager, tenant);
+    if (manager->instances[slot] != NULL) return manager->instances[slot];    /* tenant exists */
+
+    ds = (DataStructure*)poolAlloc(&manager->structures);
+    if (ds == NULL) return NULL;
+    *ds = Init(s);
+    ds->pool = &manager->products;
+
+    /* small tenant - write buffer arrays from the shared arrays pool */
+    if (manager->smallThreshold > 0)
     {
-        /* if x is a left child */
-        if (x->parent->left == x) x->parent->left = y;
-        /* if x is a right child */
-        if (x->parent->right == x) x->parent->right = y;
+        ds->bufferPool = &manager->arrays;
+        ds->bufferTime = (TimeType*)poolAlloc(&manager->arrays);
+        ds->bufferQuality = (QualityType*)poolAlloc(&manager->arrays);
+        allocated = (ds->bufferTime != NULL && ds->bufferQuality != NULL);
+#ifdef PRODUCT_PAYLOAD_TYPE
+        ds->bufferPayload = (PayloadType*)poolAlloc(&manager->arrays);
+        allocated = allocated && ds->bufferPayload != NULL;
+#endif
+        if (allocated)
+        {
+            ds->bufferCapacity = manager->smallThreshold;
+            ds->smallInstance = 1;
+        }
+        else releaseBuffer(ds);     /* fall back to trees */
     }
-    y->parent = x->parent;
-    x->parent = y;
+    manager->tenants[slot] = tenant;
+    manager->instances[slot] = ds;
+    manager->count++;
+    return ds;
+}
 
-    /* update heights */
-    updateHeight(x);
-    updateHeight(y);
+/* FUNCTION 24 - returns tenant's data structure, NULL if tenant doesnt exist (O(1)) */
+DataStructure* GetTenant(TenantManager* manager, long tenant)
+{
+    if (manager->capacity == 0) return NULL;
+    return manager->instances[tenantSlot(manager, tenant)];
+}
 
-    /* update subtree size */
-    if (x->right) x->subtreeSize = x->subtreeSize - y->subtreeSize + x->right->subtreeSize;
-    else x->subtreeSize = x->subtreeSize - y->subtreeSize;
+/* FUNCTION 25 - removes a tenant and all of its products (O(n)) */
+void RemoveTenant(TenantManager* manager, long tenant)
+{
+    int slot, next, target;
 
-    if (x->left) y->subtreeSize = y->subtreeSize + x->left->subtreeSize + 1;
-    else y->subtreeSize++;
+    if (manager->capacity == 0) return;
+    slot = tenantSlot(manager, tenant);
+    if (manager->instances[slot] == NULL) return;     /* tenant not found */
 
-    /* update min quality in subtree */
-    updateMinQuality(x);
-    updateMinQuality(y);
+    freeInstance(manager->instances[slot]);
+    poolFree(&manager->structures, manager->instances[slot]);
+    manager->instances[slot] = NULL;
+    manager->count--;
 
-    return y;
+    /* move following tenants whose probing now reaches the empty slot first into it */
+    for (next = (slot + 1) & (manager->capacity - 1); manager->instances[next] != NULL; next = (next + 1) & (manager->capacity - 1))
+    {
+        target = tenantSlot(manager, manager->tenants[next]);
+        if (target == next) continue;
+        manager->tenants[target] = manager->tenants[next];
+        manager->instances[target] = manager->instances[next];
+        manager->instances[next] = NULL;
+    }
 }
 
-/* balance the tree and return new root (O(1)) */
-Product* balance(Product* x)
+/* FUNCTION 26 - frees all tenants and the manager's memory (O(n)) */
+void FreeManager(TenantManager* manager)
 {
-    Product* y;
+    int slot;
 
-    /* if already balanced */
-    if (abs(height(x->left) - height(x->right)) <= 1) return x;
+    /* release memory tenants got outside the pools */
+    for (slot = 0; slot < manager->capacity; slot++)
+    {
+        if (manager->instances[slot] != NULL) freeInstance(manager->instances[slot]);
+    }
+    free(manager->tenants);
+    free(manager->instances);
+    freePool(&manager->products);
+    freePool(&manager->arrays);
+    freePool(&manager->structures);
+    manager->tenants = NULL;
+    manager->instances = NULL;
+    manager->capacity = 0;
+    manager->count = 0;
+}
 
-    /* if x is left heavy */
-    else if (height(x->left) > height(x->right))
+#ifdef COMBINING_WRITER
+
+/* FUNCTION 27 - starts a combiner thread, the only writer of ds until StopCombiner, NULL on failure */
+CombiningWriter* StartCombiner(DataStructure* ds)
+{
+    CombiningWriter* writer = (CombiningWriter*)malloc(sizeof(CombiningWriter));
+    if (writer == NULL) return NULL;
+
+    writer->ds = ds;
+    writer->pending = NULL;
+    writer->sleeping = 0;
+    writer->stopping = 0;
+    writer->waiters = 0;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->wake, NULL);
+    pthread_cond_init(&writer->finished, NULL);
+    if (pthread_create(&writer->thread, NULL, combinerTask, writer) != 0)
     {
-        y = x->left;
-        /* if x is left right heavy */
-        if (height(y->left) < height(y->right)) leftRotate(y);
-        return rightRotate(x);
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->wake);
+        pthread_cond_destroy(&writer->finished);
+        free(writer);
+        return NULL;
     }
-    /* if x is right heavy */
-    else
+    return writer;
+}
+
+/* FUNCTION 28 - applies all submitted operations, stops the combiner thread and frees it */
+void StopCombiner(CombiningWriter* writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    __atomic_store_n(&writer->stopping, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+
+    pthread_join(writer->thread, NULL);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->wake);
+    pthread_cond_destroy(&writer->finished);
+    free(writer);
+}
+
+/* FUNCTION 29 - submits an operation without waiting, use OperationDone / WaitOperation or a callback for completion (O(1)) */
+void SubmitOperation(CombiningWriter* writer, CombiningOperation* operation)
+{
+    operation->done = 0;
+    operation->writer = writer;
+
+    /* push to pending stack */
+    operation->next = __atomic_load_n(&writer->pending, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&writer->pending, &operation->next, operation, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    /* wake a sleeping combiner */
+    if (__atomic_load_n(&writer->sleeping, __ATOMIC_SEQ_CST))
     {
-        y = x->right;
-        /* if x is right left heavy */
-        if (height(y->left) > height(y->right)) rightRotate(y);
-        return leftRotate(x);
+        pthread_mutex_lock(&writer->lock);
+        pthread_cond_signal(&writer->wake);
+        pthread_mutex_unlock(&writer->lock);
     }
 }
 
-/* insert a product to time tree and return new root (O(logn)) */
-Product* insertTime(Product* root, Product* x)
+/* FUNCTION 30 - returns 1 if a submitted operation is done, 0 otherwise (O(1)) */
+int OperationDone(CombiningOperation* operation)
 {
-    Product* y;
+    return __atomic_load_n(&operation->done, __ATOMIC_ACQUIRE);
+}
 
-    /* base case */
-    if (root == NULL)
+/* FUNCTION 31 - waits until a submitted operation is done, spins WAIT_SPINS rounds and then sleeps until the combiner ends a batch */
+void WaitOperation(CombiningOperation* operation)
+{
+    CombiningWriter* writer = operation->writer;
+    int spins;
+
+    for (spins = 0; spins < WAIT_SPINS; spins++)
     {
-        x->height = 0;
+        if (OperationDone(operation)) return;
+        sched_yield();
+    }
+
+    /* announce sleep before the last check, the combiner checks waiters after marking operations done */
+    pthread_mutex_lock(&writer->lock);
+    __atomic_add_fetch(&writer->waiters, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&operation->done, __ATOMIC_SEQ_CST)) pthread_cond_wait(&writer->finished, &writer->lock);
+    __atomic_sub_fetch(&writer->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/* FUNCTION 32 - adds a product through the combiner and waits for it */
+void CombinedAddProduct(CombiningWriter* writer, TimeType time, QualityType quality)
+{
+    CombiningOperation operation;
+    operation.type = OPERATION_ADD;
+    operation.time = time;
+    operation.quality = quality;
+    operation.callback = NULL;
+    SubmitOperation(writer, &operation);
+    WaitOperation(&operation);
+}
+
+/* FUNCTION 33 - removes a product through the combiner and waits for it */
+void CombinedRemoveProduct(CombiningWriter* writer, TimeType time)
+{
+    CombiningOperation operation;
+    operation.type = OPERATION_REMOVE;
+    operation.time = time;
+    operation.callback = NULL;
+    SubmitOperation(writer, &operation);
+    WaitOperation(&operation);
+}
+
+#endif
+
+#ifdef SHARED_MEMORY
+
+/* FUNCTION 17 - creates named shared memory segment of size bytes holding an empty data structure, NULL on failure.
+   the segment is mapped at a free slot above SHM_ADDRESS, where reader processes can map it too.
+   every product takes two items of sizeof(Product) rounded up to 16 bytes (80 bytes with int keys) and every quality one more,
+   so a 16 MB segment holds about 104800 products - AddProduct returns 0 once the segment is full */
+DataStructure* ShmCreate(const char* name, QualityType s, size_t size)
+{
+    SharedHeader *header;
+    size_t span;
+    int fd, slot;
+
+    if (size < sizeof(SharedHeader) + 16 + sizeof(Product)) return NULL;
+
+    /* create and size the segment */
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) return NULL;
+    if (ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    /* first free slot of the shared region, any address if none is free */
+    span = (size + (1UL << 30) - 1) & ~((1UL << 30) - 1);
+    header = (SharedHeader*)MAP_FAILED;
+    for (slot = 0; SHM_ADDRESS != 0 && slot < SHM_SLOTS && header == MAP_FAILED; slot++)
+    {
+        header = (SharedHeader*)mmap((void*)(SHM_ADDRESS + slot * span), size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    }
+    if (header == MAP_FAILED) header = (SharedHeader*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    /* products are allocated after the header, pointers stay valid since readers map at the same address */
+    header->base = header;
+    header->size = size;
+    header->pool = initPool(sizeof(Product), 0);
+    header->pool.next = (char*)header + (sizeof(SharedHeader) + 15) / 16 * 16;
+    header->pool.end = (char*)header + size;
+    header->ds = Init(s);
+    header->ds.pool = &header->pool;
+    return &header->ds;
+}
+
+/* FUNCTION 18 - maps named shared memory segment read only for queries at the writer's address, NULL on failure or if the address is taken.
+   queries go between ReadBegin and ReadRetry, their walks stop early once the writer changed the segment */
+DataStructure* ShmAttach(const char* name)
+{
+    SharedHeader *header;
+    void *base, *mapped;
+    size_t size;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+
+    /* read the segment address and size from its header */
+    header = (SharedHeader*)mmap(NULL, sizeof(SharedHeader), PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+    base = header->base;
+    size = header->size;
+    munmap(header, sizeof(SharedHeader));
+
+    /* map the segment at the writer's address */
+    mapped = mmap(base, size, PROT_READ, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return NULL;
+    if (mapped != base)         /* kernel ignored the address */
+    {
+        munmap(mapped, size);
+        return NULL;
+    }
+    return &((SharedHeader*)mapped)->ds;
+}
+
+/* FUNCTION 19 - unmaps a shared memory data structure of ShmCreate or ShmAttach */
+void ShmDetach(DataStructure* ds)
+{
+    SharedHeader* header = (SharedHeader*)ds;
+    munmap(header->base, header->size);
+}
+
+#endif
+
+
+/*--------------- HELPER FUNCTIONS ----------------*/
+
+/* returns an empty pool of itemSize items, growing by chunkItems items or over a block set by the caller if 0 (O(1)) */
+MemoryPool initPool(size_t itemSize, size_t chunkItems)
+{
+    MemoryPool pool;
+    pool.freeList = NULL;
+    pool.next = NULL;
+    pool.end = NULL;
+    pool.itemSize = (max(itemSize, sizeof(void*)) + 15) / 16 * 16;
+    pool.chunkItems = chunkItems;
+    pool.chunks = NULL;
+    return pool;
+}
+
+/* allocates an item from pool, NULL on failure (O(1)) */
+void* poolAlloc(MemoryPool* pool)
+{
+    char *x, *chunk;
+
+    /* reuse a freed item */
+    if (pool->freeList != NULL)
+    {
+        x = (char*)pool->freeList;
+        pool->freeList = *(void**)x;
         return x;
     }
-    /* insert product to the left subtree */
-    if (x->time < root->time)
+    /* block is used up - add a chunk, its first 16 bytes link the chunks */
+    if (pool->next == NULL || pool->next + pool->itemSize > pool->end)
     {
-        y = insertTime(root->left, x);
-        root->left = y;
-        y->parent = root;
-        root->height = y->height + 1;   /* update height */
+        if (pool->chunkItems == 0) return NULL;
+        chunk = (char*)malloc(16 + pool->chunkItems * pool->itemSize);
+        if (chunk == NULL) return NULL;
+        *(void**)chunk = pool->chunks;
+        pool->chunks = chunk;
+        pool->next = chunk + 16;
+        pool->end = pool->next + pool->chunkItems * pool->itemSize;
     }
-    /* insert product to the right subtree */
-    else
+    /* take a never used item */
+    x = pool->next;
+    pool->next += pool->itemSize;
+    return x;
+}
+
+/* frees an item to pool (O(1)) */
+void poolFree(MemoryPool* pool, void* x)
+{
+    if (x == NULL) return;
+    *(void**)x = pool->freeList;
+    pool->freeList = x;
+}
+
+/* frees all chunks of pool, its items are no longer valid (O(chunks)) */
+void freePool(MemoryPool* pool)
+{
+    void* next;
+    for (; pool->chunks != NULL; pool->chunks = next)
     {
-        y = insertTime(root->right, x);
-        root->right = y;
-        y->parent = root;
-        root->height = y->height + 1;   /* update height */
+        next = *(void**)pool->chunks;
+        free(pool->chunks);
+    }
+    pool->freeList = NULL;
+    pool->next = NULL;
+    pool->end = NULL;
+}
+
+/* returns 1 if pool can allocate count items, always 1 for malloc and growing pools (O(count)) */
+int poolHasSpace(MemoryPool* pool, int count)
+{
+    void* x;
+    if (pool == NULL || pool->chunkItems > 0) return 1;
+
+    for (x = pool->freeList; x != NULL && count > 0; x = *(void**)x) count--;
+    return (count == 0 || (pool->next != NULL && pool->next + count * pool->itemSize <= pool->end));
+}
+
+/* allocates a product from pool, or with malloc if pool is NULL, NULL on failure (O(1)) */
+Product* allocProduct(MemoryPool* pool)
+{
+    if (pool == NULL) return (Product*)malloc(sizeof(Product));
+    return (Product*)poolAlloc(pool);
+}
+
+/* frees a product of allocProduct (O(1)) */
+void freeProduct(MemoryPool* pool, Product* x)
+{
+#ifdef ONLINE_COMPACTION
+    if (x->block != NULL)      /* product was compacted */
+    {
+        compactRelease(x);
+        return;
+    }
+#endif
+    if (pool == NULL) free(x);
+    else poolFree(pool, x);
+}
+
+/* allocates an array from pool, or size bytes with malloc if pool is NULL (O(1)) */
+void* allocArray(MemoryPool* pool, size_t size)
+{
+    if (pool == NULL) return malloc(size);
+    return poolAlloc(pool);
+}
+
+/* frees an array of allocArray (O(1)) */
+void freeArray(MemoryPool* pool, void* x)
+{
+    if (pool == NULL) free(x);
+    else poolFree(pool, x);
+}
+
+/* frees write buffer arrays and turns off write buffer mode, buffer must be empty (O(1)) */
+void releaseBuffer(DataStructure* ds)
+{
+    freeArray(ds->bufferPool, ds->bufferTime);
+    freeArray(ds->bufferPool, ds->bufferQuality);
+#ifdef PRODUCT_PAYLOAD_TYPE
+    freeArray(ds->bufferPool, ds->bufferPayload);
+    ds->bufferPayload = NULL;
+#endif
+    ds->bufferTime = NULL;
+    ds->bufferQuality = NULL;
+    ds->bufferSize = 0;
+    ds->bufferCapacity = 0;
+    ds->bufferDraining = 0;
+    ds->smallInstance = 0;
+}
+
+/* frees all products of a time tree (O(n)) */
+void freeTimeTree(MemoryPool* pool, Product* root)
+{
+    if (root == NULL) return;
+    freeTimeTree(pool, root->left);
+    freeTimeTree(pool, root->right);
+    freeProduct(pool, root);
+}
+
+/* frees all quality nodes of a quality tree and their time subtrees (O(n)) */
+void freeQualityTree(MemoryPool* pool, Product* root)
+{
+    if (root == NULL) return;
+    freeQualityTree(pool, root->left);
+    freeQualityTree(pool, root->right);
+    freeTimeTree(pool, root->timeSubtree);
+    freeProduct(pool, root);
+}
+
+/* frees all products and arrays of a data structure, leaving it empty (O(n)) */
+void freeInstance(DataStructure* ds)
+{
+    writeBegin(ds);
+    freeTimeTree(ds->pool, ds->timeRoot);
+    freeQualityTree(ds->pool, ds->qualityRoot);
+    ds->timeRoot = NULL;
+    ds->qualityRoot = NULL;
+    ds->specialExists = 0;
+    releaseBuffer(ds);
+#ifdef BUCKET_TIME_INDEX
+    freeBuckets(ds->bucketRoot);
+    ds->bucketRoot = NULL;
+#endif
+#ifdef DOMINANCE_INDEX
+    freeDominance(ds->dominanceRoot);
+    ds->dominanceRoot = NULL;
+    ds->dominanceRemoved = 0;
+#endif
+#ifdef ONLINE_COMPACTION
+    freeCompactBlocks(ds);
+#endif
+#ifdef QUALITY_SKETCH
+    freeSketches(ds);
+#endif
+#ifdef LAZY_DELETE
+    ds->tombstones = 0;
+#endif
+    writeEnd(ds);
+}
+
+/* returns tenant's slot, or the empty slot it would take (O(1) expected) */
+int tenantSlot(TenantManager* manager, long tenant)
+{
+    unsigned long long hash = (unsigned long long)tenant * 0x9E3779B97F4A7C15ULL;
+    int mask = manager->capacity - 1;
+    int slot = (int)(hash >> 32) & mask;
+
+    /* linear probing */
+    while (manager->instances[slot] != NULL && manager->tenants[slot] != tenant) slot = (slot + 1) & mask;
+    return slot;
+}
+
+/* doubles tenants hash table, returns 0 if allocation failed (O(tenants)) */
+int growTenants(TenantManager* manager)
+{
+    TenantManager old = *manager;
+    int j, slot;
+
+    manager->capacity = (old.capacity ? 2 * old.capacity : 16);
+    manager->tenants = (long*)malloc(manager->capacity * sizeof(long));
+    manager->instances = (DataStructure**)calloc(manager->capacity, sizeof(DataStructure*));
+    if (manager->tenants == NULL || manager->instances == NULL)
+    {
+        free(manager->tenants);
+        free(manager->instances);
+        *manager = old;
+        return 0;
+    }
+    /* move tenants to their new slots */
+    for (j = 0; j < old.capacity; j++)
+    {
+        if (old.instances[j] == NULL) continue;
+        slot = tenantSlot(manager, old.tenants[j]);
+        manager->tenants[slot] = old.tenants[j];
+        manager->instances[slot] = old.instances[j];
+    }
+    free(old.tenants);
+    free(old.instances);
+    return 1;
+}
+
+/* starts a write - makes seqlock version odd (O(1)) */
+void writeBegin(DataStructure* ds)
+{
+#ifdef SHARED_MEMORY
+    readStructure = NULL;                 /* the writer's own walks are never torn */
+#endif
+    if (ds->writeDepth++ > 0) return;     /* nested write */
+    __atomic_store_n(&ds->version, ds->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* ends a write - makes seqlock version even again (O(1)) */
+void writeEnd(DataStructure* ds)
+{
+    if (--ds->writeDepth > 0) return;     /* nested write */
+    __atomic_store_n(&ds->version, ds->version + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef SHARED_MEMORY
+
+/* counts a step of a reader's walk, returns 0 once a write ran since ReadBegin, so a walk over torn pointers can't loop forever.
+   the query ends early with a wrong result and ReadRetry repeats it (O(1)) */
+int readStep(void)
+{
+    if (readStructure == NULL) return 1;      /* not inside ReadBegin / ReadRetry */
+    if (!readTorn && ++readSteps % READ_CHECK_STEPS == 0)
+    {
+        readTorn = (__atomic_load_n(&readStructure->version, __ATOMIC_ACQUIRE) != readVersion);
+    }
+    return !readTorn;
+}
+
+#endif
+
+/* compares two products by quality & time, returns negative if first is smaller (O(1)) */
+int compareProducts(TimeType time1, QualityType quality1, TimeType time2, QualityType quality2)
+{
+    if (quality1 != quality2) return (quality1 < quality2 ? -1 : 1);
+    if (time1 != time2) return (time1 < time2 ? -1 : 1);
+    return 0;
+}
+
+/* returns index of product with time in write buffer, -1 if not found (O(capacity)) */
+int bufferFindTime(DataStructure* ds, TimeType time)
+{
+    int j;
+    for (j = 0; j < ds->bufferSize; j++)
+    {
+        if (ds->bufferTime[j] == time) return j;
+    }
+    return -1;
+}
+
+/* inserts a product to write buffer keeping it sorted by quality & time (O(capacity)) */
+void bufferInsert(DataStructure* ds, TimeType time, QualityType quality)
+{
+    int j = ds->bufferSize;
+
+    /* shift bigger products one place right */
+    while (j > 0 && compareProducts(time, quality, ds->bufferTime[j-1], ds->bufferQuality[j-1]) < 0)
+    {
+        ds->bufferTime[j] = ds->bufferTime[j-1];
+        ds->bufferQuality[j] = ds->bufferQuality[j-1];
+#ifdef PRODUCT_PAYLOAD_TYPE
+        ds->bufferPayload[j] = ds->bufferPayload[j-1];
+#endif
+        j--;
+    }
+    ds->bufferTime[j] = time;
+    ds->bufferQuality[j] = quality;
+#ifdef PRODUCT_PAYLOAD_TYPE
+    memset(&ds->bufferPayload[j], 0, sizeof(PayloadType));
+#endif
+    ds->bufferSize++;
+}
+
+/* removes product at index from write buffer (O(capacity)) */
+void bufferRemoveAt(DataStructure* ds, int index)
+{
+    int j;
+    for (j = index; j < ds->bufferSize - 1; j++)
+    {
+        ds->bufferTime[j] = ds->bufferTime[j+1];
+        ds->bufferQuality[j] = ds->bufferQuality[j+1];
+#ifdef PRODUCT_PAYLOAD_TYPE
+        ds->bufferPayload[j] = ds->bufferPayload[j+1];
+#endif
+    }
+    ds->bufferSize--;
+}
+
+/* moves the last count products of write buffer to time tree and quality tree, the buffer stays sorted (O(count * logn)) */
+void drainBuffer(DataStructure* ds, int count)
+{
+    Product *timeProduct, *qualityProduct, *qualityNode, *newTimeRoot, *x;
+    int j;
+
+    qualityNode = NULL;
+    for (j = ds->bufferSize - 1; j >= ds->bufferSize - count; j--)
+    {
+        /* insert to time tree (O(logn)) */
+        timeProduct = creatNewProduct(ds->pool, ds->bufferTime[j], ds->bufferQuality[j]);
+#ifdef PRODUCT_PAYLOAD_TYPE
+        timeProduct->payload = ds->bufferPayload[j];
+#endif
+        newTimeRoot = insertTime(ds->timeRoot, timeProduct);
+        ds->timeRoot = newTimeRoot;
+
+        qualityProduct = creatNewProduct(ds->pool, ds->bufferTime[j], ds->bufferQuality[j]);
+
+        /* buffer is sorted by quality - search quality node once for all products of the same quality */
+        if (qualityNode == NULL || qualityNode->quality != ds->bufferQuality[j])
+        {
+            qualityNode = searchQuality(ds->qualityRoot, ds->bufferQuality[j]);
+            if (qualityNode != NULL && qualityNode->quality != ds->bufferQuality[j]) qualityNode = NULL;
+        }
+
+        /* insert to existing quality's time subtree without rebalancing the quality tree (O(logn)) */
+        if (qualityNode != NULL)
+        {
+            qualityNode->timeSubtree = insertTime(qualityNode->timeSubtree, qualityProduct);
+            for (x = qualityNode; x != NULL; x = x->parent) x->subtreeSize++;   /* update subtree sizes */
+        }
+        /* new quality - insert to quality tree (O(logn)) */
+        else ds->qualityRoot = insertQuality(ds->pool, ds->qualityRoot, qualityProduct);
+
+        /* update twin pointers */
+        timeProduct->twin = qualityProduct;
+        qualityProduct->twin = timeProduct;
+#ifdef BUCKET_TIME_INDEX
+        ds->bucketRoot = bucketInsert(ds->bucketRoot, ds->bufferTime[j], ds->bufferQuality[j]);
+#endif
+#ifdef DOMINANCE_INDEX
+        ds->dominanceRoot = dominanceInsert(ds->dominanceRoot, ds->bufferTime[j], ds->bufferQuality[j], &ds->dominanceRemoved);
+#endif
+    }
+    ds->bufferSize -= count;
+}
+
+/* returns 1 if a product with quality is in write buffer, 0 otherwise (O(capacity)) */
+int bufferHasQuality(DataStructure* ds, QualityType quality)
+{
+    int j;
+    for (j = 0; j < ds->bufferSize; j++)
+    {
+        if (ds->bufferQuality[j] == quality) return 1;
+    }
+    return 0;
+}
+
+/* creates a new Product and returns it (O(1))*/
+Product* creatNewProduct(MemoryPool* pool, TimeType newTime, QualityType newQuality)
+{
+    /* allocate memory for new product */
+    Product* newProduct = allocProduct(pool);
+    if (newProduct == NULL) return NULL;
+    newProduct->quality = newQuality;
+    newProduct->time = newTime;
+    newProduct->left = NULL;
+    newProduct->right = NULL;
+    newProduct->parent = NULL;
+    newProduct->twin = NULL;
+    newProduct->timeSubtree = NULL;
+    newProduct->minQualityP = newProduct;
+#ifdef ONLINE_COMPACTION
+    newProduct->block = NULL;
+#endif
+    newProduct->height = 0;
+    newProduct->subtreeSize = 1;
+    newProduct->minQuality = newQuality;
+#ifdef LAZY_DELETE
+    newProduct->dead = 0;
+#endif
+#ifdef PRODUCT_PAYLOAD_TYPE
+    memset(&newProduct->payload, 0, sizeof(PayloadType));
+#endif
+    return newProduct;
+}
+
+/* creates a new quality node and returns it (O(1))*/
+Product* createQualityNode(MemoryPool* pool, QualityType newQuality)
+{
+    /* allocate memory for new quality node */
+    Product *newQualityNode = allocProduct(pool);
+    if (newQualityNode == NULL) return NULL;
+    newQualityNode->quality = newQuality;
+    newQualityNode->time = 0;                   /* irrelevent for this type of node */
+    newQualityNode->left = NULL;
+    newQualityNode->right = NULL;
+    newQualityNode->parent = NULL;
+    newQualityNode->twin = NULL;                /* irrelevent for this type of node */
+    newQualityNode->timeSubtree = NULL;
+    newQualityNode->minQualityP = NULL;         /* irrelevent for this type of node */
+#ifdef ONLINE_COMPACTION
+    newQualityNode->block = NULL;
+#endif
+    newQualityNode->height = 0;
+    newQualityNode->subtreeSize = 0;
+    newQualityNode->minQuality = newQuality;    /* irrelevent for this type of node */
+#ifdef LAZY_DELETE
+    newQualityNode->dead = 0;                   /* quality nodes are removed when their time subtree is empty */
+#endif
+    return newQualityNode;
+}
+
+/* swaps between two products (O(1)) */
+void swapProduct(Product* a, Product* b)
+{
+    Product* temp;
+
+    /* update time and quality */
+    a->time = b->time;
+    a->quality = b->quality;
+#ifdef PRODUCT_PAYLOAD_TYPE
+    a->payload = b->payload;
+#endif
+#ifdef LAZY_DELETE
+    a->dead = b->dead;
+#endif
+
+    /* a takes b's place, so b's twin now points to a */
+    a->twin = b->twin;
+    if (a->twin) a->twin->twin = a;
+
+    /* swap time subtree */
+    temp = a->timeSubtree;
+    a->timeSubtree = b->timeSubtree;
+    b->timeSubtree = temp;
+}
+
+/* search a product in time tree and returns a pointer to found product / its successor or predeccessor (O(logn)) */
+Product* searchTime(Product* root, TimeType time)
+{
+    Product *y = NULL;
+    Product *z = root;
+    while (z != NULL && READ_STEP())
+    {
+        y = z;
+        if (time == z->time) return z;
+        if (time < z->time) z = z->left;
+        else z = z->right;
+    }
+    return y;
+}
+
+/* search a product in quality tree and return a pointer to found node / its successor or predecessor (O(logn)) */
+Product* searchQuality(Product* root, QualityType quality)
+{
+    Product *y = NULL;
+    Product *z = root;
+    while (z != NULL && READ_STEP())
+    {
+        y = z;
+        if (quality == z->quality) return z;
+        if (quality < z->quality) z = z->left;
+        else z = z->right;
+    }
+    return y;
+}
+
+/* returns a nodes height (O(1)) */
+int height(Product* x)
+{
+    int leftHeight, rightHeight;
+
+    /* if product is NULL, height is -1 */
+    if (x == NULL) return -1;
+
+    /* get the height of the subtrees and return the max height + 1*/
+    leftHeight = (x->left ? x->left->height : -1);
+    rightHeight = (x->right ? x->right->height : -1);
+    return (max(leftHeight, rightHeight) + 1);
+}
+
+/* gets a product and updates its height (O(1)) */
+void updateHeight(Product* x)
+{
+    x->height = height(x);
+}
+
+/* gets two products and returns the smaller product by quality & time (O(1)) */
+Product* minOfTwoProducts(Product* x, Product* y)
+{
+    if (x == NULL) return y;
+    if (y == NULL) return x;
+
+    /* compare by quality */
+    if (x->quality < y->quality) return x;
+    if (x->quality > y->quality) return y;
+
+    /* compare by time */
+    return (x->time < y->time ? x : y);
+}
+
+/* returns x, or NULL if x is a tombstone (O(1)) */
+Product* liveProduct(Product* x)
+{
+#ifdef LAZY_DELETE
+    if (x != NULL && x->dead) return NULL;
+#endif
+    return x;
+}
+
+/* returns 1 for a product, 0 for a tombstone (O(1)) */
+int productWeight(Product* x)
+{
+    return (liveProduct(x) != NULL);
+}
+
+/* updating minimum quality pointer from x and its children's minimums, NULL if all are tombstones (O(1)) */
+void updateMinQuality(Product* x)
+{
+    if (x == NULL) return;
+
+    /* comparing x with the minimum of each child subtree */
+    x->minQualityP = liveProduct(x);
+    if (x->left) x->minQualityP = minOfTwoProducts(x->minQualityP, x->left->minQualityP);
+    if (x->right) x->minQualityP = minOfTwoProducts(x->minQualityP, x->right->minQualityP);
+    if (x->minQualityP) x->minQuality = x->minQualityP->quality;
+}
+
+/* right rotation (O(1)) */
+Product* rightRotate(Product* x)
+{
+    int size;
+
+    /* update left and right pointers */
+    Product* y = x->left;
+    x->left = y->right;
+    if (x->left) x->left->parent = x;
+    y->right = x;
+
+    /* update parents */
+    if (x->parent)
+    {
+        /* if x is a left child */
+        if (x->parent->left == x) x->parent->left = y;
+        /* if x is a right child */
+        if (x->parent->right == x) x->parent->right = y;
+    }
+    y->parent = x->parent;
+    x->parent = y;
+
+    /* update heights - WAVL ranks are updated by the caller */
+    if (balancePolicy == AVL_POLICY)
+    {
+        updateHeight(x);
+        updateHeight(y);
+    }
+#if defined(BALANCE_BENCHMARK) || defined(SELF_TEST)
+    rotationCount++;
+#endif
+
+    /* update subtree size - y takes x's whole subtree */
+    size = x->subtreeSize;
+    if (x->left) x->subtreeSize = x->subtreeSize - y->subtreeSize + x->left->subtreeSize;
+    else x->subtreeSize = x->subtreeSize - y->subtreeSize;
+    y->subtreeSize = size;
+
+    /* update min quality in subtree */
+    updateMinQuality(x);
+    updateMinQuality(y);
+
+    return y;
+}
+
+/* left rotation (O(1)) */
+Product* leftRotate(Product* x)
+{
+    int size;
+
+    /* update left and right pointers */
+    Product* y = x->right;
+    x->right = y->left;
+    if (x->right) x->right->parent = x;
+    y->left = x;
+
+    /* update parent */
+    if (x->parent)
+    {
+        /* if x is a left child */
+        if (x->parent->left == x) x->parent->left = y;
+        /* if x is a right child */
+        if (x->parent->right == x) x->parent->right = y;
+    }
+    y->parent = x->parent;
+    x->parent = y;
+
+    /* update heights - WAVL ranks are updated by the caller */
+    if (balancePolicy == AVL_POLICY)
+    {
+        updateHeight(x);
+        updateHeight(y);
+    }
+#if defined(BALANCE_BENCHMARK) || defined(SELF_TEST)
+    rotationCount++;
+#endif
+
+    /* update subtree size - y takes x's whole subtree */
+    size = x->subtreeSize;
+    if (x->right) x->subtreeSize = x->subtreeSize - y->subtreeSize + x->right->subtreeSize;
+    else x->subtreeSize = x->subtreeSize - y->subtreeSize;
+    y->subtreeSize = size;
+
+    /* update min quality in subtree */
+    updateMinQuality(x);
+    updateMinQuality(y);
+
+    return y;
+}
+
+/* balance the tree and return new root (O(1)) */
+Product* balance(Product* x)
+{
+    Product* y;
+
+    /* if already balanced */
+    if (abs(height(x->left) - height(x->right)) <= 1) return x;
+
+    /* if x is left heavy */
+    else if (height(x->left) > height(x->right))
+    {
+        y = x->left;
+        /* if x is left right heavy */
+        if (height(y->left) < height(y->right)) leftRotate(y);
+        return rightRotate(x);
+    }
+    /* if x is right heavy */
+    else
+    {
+        y = x->right;
+        /* if x is right left heavy */
+        if (height(y->left) > height(y->right)) rightRotate(y);
+        return leftRotate(x);
+    }
+}
+
+/* returns stored height / rank of a product, -1 for NULL (O(1)) */
+int nodeRank(Product* x)
+{
+    return (x ? x->height : -1);
+}
+
+/* rebalance after insert with the chosen policy, returns new root (O(1)) */
+Product* rebalanceInsert(Product* x)
+{
+    if (balancePolicy == WAVL_POLICY) return wavlRebalanceInsert(x);
+    return avlRebalanceInsert(x);
+}
+
+/* rebalance after delete with the chosen policy, returns new root (O(1)) */
+Product* rebalanceDelete(Product* x)
+{
+    if (balancePolicy == WAVL_POLICY) return wavlRebalanceDelete(x);
+    return avlRebalanceDelete(x);
+}
+
+/* AVL - update height after insert and balance, returns new root (O(1)) */
+Product* avlRebalanceInsert(Product* x)
+{
+    updateHeight(x);
+    return balance(x);
+}
+
+/* AVL - update height after delete and balance, returns new root (O(1)) */
+Product* avlRebalanceDelete(Product* x)
+{
+    updateHeight(x);
+    return balance(x);
+}
+
+/* WAVL - fix a 0-child after insert by promoting x or rotating, returns new root (O(1)) */
+Product* wavlRebalanceInsert(Product* x)
+{
+    Product *z, *w;
+    int r = x->height;
+
+    /* left child has same rank as x */
+    if (nodeRank(x->left) == r)
+    {
+        /* sibling is a 1-child - promote x, parent will check it */
+        if (r - nodeRank(x->right) == 1)
+        {
+            x->height++;
+            return x;
+        }
+        z = x->left;
+
+        /* outer child of z is its 1-child - single rotation */
+        if (z->height - nodeRank(z->left) == 1)
+        {
+            rightRotate(x);
+            x->height--;
+            return z;
+        }
+        /* inner child of z is its 1-child - double rotation */
+        w = z->right;
+        leftRotate(z);
+        rightRotate(x);
+        w->height++;
+        z->height--;
+        x->height--;
+        return w;
+    }
+    /* right child has same rank as x */
+    if (nodeRank(x->right) == r)
+    {
+        /* sibling is a 1-child - promote x, parent will check it */
+        if (r - nodeRank(x->left) == 1)
+        {
+            x->height++;
+            return x;
+        }
+        z = x->right;
+
+        /* outer child of z is its 1-child - single rotation */
+        if (z->height - nodeRank(z->right) == 1)
+        {
+            leftRotate(x);
+            x->height--;
+            return z;
+        }
+        /* inner child of z is its 1-child - double rotation */
+        w = z->left;
+        rightRotate(z);
+        leftRotate(x);
+        w->height++;
+        z->height--;
+        x->height--;
+        return w;
+    }
+    return x;
+}
+
+/* WAVL - fix a 2,2 leaf or a 3-child after delete by demoting x or rotating, returns new root (O(1)) */
+Product* wavlRebalanceDelete(Product* x)
+{
+    Product *y, *w;
+    int r = x->height;
+
+    /* leaves have rank 0 */
+    if (x->left == NULL && x->right == NULL)
+    {
+        x->height = 0;
+        return x;
+    }
+    /* left child is a 3-child */
+    if (r - nodeRank(x->left) == 3)
+    {
+        y = x->right;
+
+        /* sibling is a 2-child, or a 2,2 node - demote, parent will check it */
+        if (r - y->height == 2)
+        {
+            x->height--;
+            return x;
+        }
+        if (y->height - nodeRank(y->left) == 2 && y->height - nodeRank(y->right) == 2)
+        {
+            x->height--;
+            y->height--;
+            return x;
+        }
+        /* outer child of y is its 1-child - single rotation */
+        if (y->height - nodeRank(y->right) == 1)
+        {
+            leftRotate(x);
+            y->height++;
+            x->height--;
+            if (x->left == NULL && x->right == NULL) x->height = 0;
+            return y;
+        }
+        /* inner child of y is its 1-child - double rotation */
+        w = y->left;
+        rightRotate(y);
+        leftRotate(x);
+        w->height += 2;
+        y->height--;
+        x->height -= 2;
+        return w;
+    }
+    /* right child is a 3-child */
+    if (r - nodeRank(x->right) == 3)
+    {
+        y = x->left;
+
+        /* sibling is a 2-child, or a 2,2 node - demote, parent will check it */
+        if (r - y->height == 2)
+        {
+            x->height--;
+            return x;
+        }
+        if (y->height - nodeRank(y->left) == 2 && y->height - nodeRank(y->right) == 2)
+        {
+            x->height--;
+            y->height--;
+            return x;
+        }
+        /* outer child of y is its 1-child - single rotation */
+        if (y->height - nodeRank(y->left) == 1)
+        {
+            rightRotate(x);
+            y->height++;
+            x->height--;
+            if (x->left == NULL && x->right == NULL) x->height = 0;
+            return y;
+        }
+        /* inner child of y is its 1-child - double rotation */
+        w = y->right;
+        leftRotate(y);
+        rightRotate(x);
+        w->height += 2;
+        y->height--;
+        x->height -= 2;
+        return w;
+    }
+    return x;
+}
+
+/* insert a product to time tree and return new root (O(logn)) */
+Product* insertTime(Product* root, Product* x)
+{
+    Product* y;
+
+    /* base case */
+    if (root == NULL)
+    {
+        x->height = 0;
+        return x;
+    }
+    /* insert product to the left subtree */
+    if (x->time < root->time)
+    {
+        y = insertTime(root->left, x);
+        root->left = y;
+        y->parent = root;
+    }
+    /* insert product to the right subtree */
+    else
+    {
+        y = insertTime(root->right, x);
+        root->right = y;
+        y->parent = root;
+    }
+    /* increment subtree size */
+    root->subtreeSize++;
+
+    /* update minimum quality in subtree */
+    updateMinQuality(root);
+
+    /* update height and balance the tree */
+    root = rebalanceInsert(root);
+
+    return root;
+}
+
+/* insert a product to quality tree and return new root (O(logn)) */
+Product* insertQuality(MemoryPool* pool, Product* root, Product* x)
+{
+    Product* y, *newQuality, *newTimeRoot;
+
+    /* base case */
+    if (root == NULL)
+    {
+        newQuality = createQualityNode(pool, x->quality);               /* create a quality node */
+        newTimeRoot = insertTime(newQuality->timeSubtree, x);           /* add product to quality's time subtree */
+        newQuality->timeSubtree = newTimeRoot;                          /* update new time subtree root */
+        newQuality->subtreeSize += newTimeRoot->subtreeSize;            /* add time subtree to subtree size */
+        return newQuality;
+    }
+    /* insert product to the left subtree */
+    if (x->quality < root->quality)
+    {
+        y = insertQuality(pool, root->left, x);
+        root->left = y;
+        y->parent = root;
+    }
+    /* insert product to the right subtree */
+    if (x->quality > root->quality)
+    {
+        y = insertQuality(pool, root->right, x);
+        root->right = y;
+        y->parent = root;
+    }
+    /* insert product to existing quality */
+    if (x->quality == root->quality)
+    {
+        newTimeRoot = insertTime(root->timeSubtree, x);             /* add product to quality's time subtree */
+        root->timeSubtree = newTimeRoot;                            /* update time subtree root */
+        root->subtreeSize++;                                        /* update subtree size */
+        return root;
+    }
+    root->subtreeSize++;        /* update subtree size */
+    updateMinQuality(root);             /* keep minimum pointer valid for rotations */
+    root = rebalanceInsert(root);       /* update height and balance the tree */
+    return root;
+}
+
+/* returns the minimum product in tree (O(logn)) */
+Product* minProduct(Product* root)
+{
+    Product* current = root;
+    if (root == NULL) return NULL;
+    
+    /* go to the far left product */
+    while (current->left != NULL) current = current->left;
+    return current;
+}
+
+/* returns maximum product in tree (O(logn)) */
+Product* maxProduct(Product* root)
+{
+    Product* current = root;
+    if (root == NULL) return NULL;
+
+    /* go to the far right */
+    while (current->right != NULL) current = current->right;
+    return current;
+}
+
+/* removes a product from time tree and returns a pointer to new root (O(logn)) */
+Product* removeProductFromTime(MemoryPool* pool, Product* root, TimeType time)
+{
+    Product *temp;
+
+    /* base case */
+    if (root == NULL) return NULL;
+    temp = NULL;
+
+    /* search left subtree */
+    if (root->time > time) root->left = removeProductFromTime(pool, root->left, time);
+
+    /* search in right subtree */
+    else if (root->time < time) root->right = removeProductFromTime(pool, root->right, time);
+
+    /* if we found the product to remove */
+    else
+    {
+        /* if it has one child or no children */
+        if (root->left == NULL || root->right == NULL)
+        {
+            if (root->left == NULL) temp = root->right;
+            else if (root->right == NULL) temp = root->left;
+
+            /* update parent pointers */
+            if (temp) temp->parent = root->parent;
+
+            freeProduct(pool, root);
+            return temp;
+        }
+        /* if it has two children */
+        temp = minProduct(root->right);                                 /* find successor */
+        swapProduct(root, temp);                                        /* root = successor */
+        root->right = removeProductFromTime(pool, root->right, temp->time);   /* remove successor place product */
+    }
+    /* if it has only one node */
+    if (root == NULL) return root;
+
+    /* update height of current node and balance the tree */
+    updateMinQuality(root);
+    updateSubtreeSize(root);
+    return rebalanceDelete(root);
+}
+
+/* removes a product from quality tree and returns new root (O(logn)) */
+Product* removeProductFromQuality(MemoryPool* pool, Product* root, TimeType time, QualityType quality)
+{
+    Product* temp, *newTimeRoot;
+
+    /* base case */
+    if (root == NULL) return NULL;
+    temp = NULL;
+
+    /* search left subtree */
+    if (root->quality > quality) root->left = removeProductFromQuality(pool, root->left, time, quality);
+
+    /* search right subtree */
+    else if (root->quality < quality) root->right = removeProductFromQuality(pool, root->right, time, quality);
+
+    /* found quality */
+    else
+    {
+        /* remove product from time subtree (O(logn)) */
+       newTimeRoot = NULL;
+        if (root->timeSubtree != NULL) newTimeRoot = removeProductFromTime(pool, root->timeSubtree, time);
+
+        if (newTimeRoot == NULL)    /* remove quality node */
+        {
+            if (root->quality == quality) root->timeSubtree = NULL;
+
+            /* if it has one child or no children */
+            if (root->left == NULL || root->right == NULL)
+            {
+                if (root->left == NULL) temp = root->right;
+                else if (root->right == NULL) temp = root->left;
+                if (temp) temp->parent = root->parent;                          /* update parent pointers */
+                freeProduct(pool, root);
+                root = NULL;
+                return temp;
+            }
+            /* if it has two children */
+            temp = minProduct(root->right);                                             /* find successor */
+            swapProduct(root, temp);                                                    /* root = successor */
+            root->right = removeProductFromQuality(pool, root->right, temp->time, temp->quality);     /* remove successor place product */
+        }
+        else root->timeSubtree = newTimeRoot;    /* update time subtree */
+    }
+    /* if it has only one node */
+    if (root == NULL) return root;
+
+    /* update height and subtree size of current node and balance the tree */
+    updateMinQuality(root);
+    root->subtreeSize = timeSubtreeSize(root) + (root->left ? root->left->subtreeSize : 0) + (root->right ? root->right->subtreeSize : 0);
+    return rebalanceDelete(root);
+}
+
+/* returns time subtree size of a quality type node */
+int timeSubtreeSize(Product* qualityRoot)
+{
+    Product* timeRoot;
+    if (qualityRoot == NULL) return 0;
+    timeRoot = qualityRoot->timeSubtree;
+    return (timeRoot ? timeRoot->subtreeSize : 0);
+}
+
+/* gets time root and returns the ith product (O(logn)) */
+Product* findIthTime(Product* root, int i)
+{
+    int leftSize;
+    
+    if (root == NULL || !READ_STEP()) return NULL;  /* base case */
+
+    leftSize = (root->left ? root->left->subtreeSize : 0);
+
+    /* if i is out of range */
+    if (i < 1 || i > root->subtreeSize) return NULL;
+
+    /* found i-th rank product */
+    if (i == leftSize + 1 && productWeight(root)) return root;
+
+    /* check left subtree */
+    else if (i <= leftSize) return findIthTime(root->left, i);
+
+    /* check right subtree */
+    else return findIthTime(root->right, i - leftSize - productWeight(root));
+}
+
+/* gets quality tree root and returns the i-th rank product (O(logn)) */
+Product* findIthQuality(Product* root, int i)
+{
+    int leftSize;
+    
+    if (root == NULL || !READ_STEP()) return NULL;   /* base case */
+
+    leftSize = (root->left ? root->left->subtreeSize : 0);
+
+    /* if i is out of range */
+    if (i < 1 || i > root->subtreeSize) return NULL;
+
+    /* ith product is in current node time subtree */
+    if (i > leftSize && i <= leftSize + timeSubtreeSize(root))
+    {
+        return findIthTime(root->timeSubtree, i - leftSize);
+    }
+
+    /* ith product is in left subtree */
+    else if (i <= leftSize) return findIthQuality(root->left, i);
+
+    /* ith product is in right subtree */
+    else return findIthQuality(root->right, i - leftSize - timeSubtreeSize(root));
+}
+
+/* returns if a products time is between time1 and time2 */
+int isInRange(Product* x, TimeType time1, TimeType time2)
+{
+    if (x == NULL) return 0;
+    return (x->time >= time1 && x->time <= time2);
+}
+
+/* find product by time or its successor if doesnt exists (O(logn)) */
+Product* findTimeOrSuccessor(Product* root, TimeType time)
+{
+    Product* successor = NULL;
+    while (root != NULL && READ_STEP())
+    {
+        if (root->time > time)
+        {
+            successor = root;
+            root = root->left;
+        }
+        else if (root->time < time) root = root->right;
+        else return root;   /* found time */
+    }
+    return successor;       /* time not found, return successor */
+}
+
+/* find product by time or predecessor if doesnt exists (O(logn)) */
+Product* findTimeOrPredecessor(Product* root, TimeType time)
+{
+    Product* predecessor = NULL;
+    while (root != NULL && READ_STEP())
+    {
+        if (root->time < time)
+        {
+            predecessor = root;
+            root = root->right;
+        }
+        else if (root->time > time) root = root->left;
+        else return root;       /* found time */
+    }
+    return predecessor;         /* time not found, return predecessor */
+}
+
+/* returns minimum quality product with time between left and right (O(logn)) */
+Product* findMinQualityBetween(Product* root, TimeType left, TimeType right)
+{
+    Product *min, *x;
+
+    /* find the first product in range - the paths to left and right split there */
+    while (root != NULL && !isInRange(root, left, right) && READ_STEP()) root = (root->time < left ? root->right : root->left);
+
+    /* empty range */
+    if (root == NULL) return NULL;
+    min = liveProduct(root);
+
+    /* path to left - right subtrees of products in range are all in range */
+    for (x = root->left; x != NULL && READ_STEP(); )
+    {
+        if (x->time >= left)
+        {
+            min = minOfTwoProducts(min, liveProduct(x));
+            if (x->right) min = minOfTwoProducts(min, x->right->minQualityP);
+            x = x->left;
+        }
+        else x = x->right;
+    }
+
+    /* path to right - left subtrees of products in range are all in range */
+    for (x = root->right; x != NULL && READ_STEP(); )
+    {
+        if (x->time <= right)
+        {
+            min = minOfTwoProducts(min, liveProduct(x));
+            if (x->left) min = minOfTwoProducts(min, x->left->minQualityP);
+            x = x->right;
+        }
+        else x = x->left;
+    }
+    return min;
+}
+
+/* returns how many products are between time1 and time2 (O(logn)) */
+int countProducts(Product* root, TimeType time1, TimeType time2)
+{
+    if (time1 > time2) return 0;
+    return countTimesUpTo(root, time2) - countSmallerTimes(root, time1);
+}
+
+/* returns how many products in time tree have time smaller than time (O(logn)) */
+int countSmallerTimes(Product* root, TimeType time)
+{
+    int counter = 0;
+    while (root != NULL && READ_STEP())
+    {
+        if (root->time < time)
+        {
+            counter += (root->left ? root->left->subtreeSize : 0) + productWeight(root);
+            root = root->right;
+        }
+        else root = root->left;
+    }
+    return counter;
+}
+
+/* returns how many products in time tree have time smaller or equal to time (O(logn)) */
+int countTimesUpTo(Product* root, TimeType time)
+{
+    int counter = 0;
+    while (root != NULL && READ_STEP())
+    {
+        if (root->time <= time)
+        {
+            counter += (root->left ? root->left->subtreeSize : 0) + productWeight(root);
+            root = root->right;
+        }
+        else root = root->left;
+    }
+    return counter;
+}
+
+/* returns how many products in quality tree are smaller than given product by quality & time (O(logn)) */
+int countSmallerProducts(Product* qualityRoot, TimeType time, QualityType quality)
+{
+    int counter = 0;
+    while (qualityRoot != NULL && READ_STEP())
+    {
+        if (quality < qualityRoot->quality) qualityRoot = qualityRoot->left;
+        else if (quality > qualityRoot->quality)
+        {
+            counter += (qualityRoot->left ? qualityRoot->left->subtreeSize : 0) + timeSubtreeSize(qualityRoot);
+            qualityRoot = qualityRoot->right;
+        }
+        /* same quality - count smaller times in its time subtree */
+        else return counter + (qualityRoot->left ? qualityRoot->left->subtreeSize : 0) + countSmallerTimes(qualityRoot->timeSubtree, time);
+    }
+    return counter;
+}
+
+/* returns the minimum product of a heap entry (O(1)) */
+Product* heapKey(HeapEntry entry)
+{
+    return entry.key;
+}
+
+/* pushes a product / whole subtree to heap, returns 0 if allocation failed (O(logn)) */
+int heapPush(ProductHeap* heap, Product* x, int whole)
+{
+    HeapEntry *entries, temp;
+    Product *a, *b, *key;
+    int j;
+
+    /* nothing to push - NULL, a tombstone or a subtree of tombstones */
+    if (x == NULL) return 1;
+    key = (whole ? x->minQualityP : liveProduct(x));
+    if (key == NULL) return 1;
+
+    /* double heap capacity */
+    if (heap->size == heap->capacity)
+    {
+        entries = (HeapEntry*)realloc(heap->entries, 2 * heap->capacity * sizeof(HeapEntry));
+        if (entries == NULL)
+        {
+            heap->failed = 1;
+            return 0;
+        }
+        heap->entries = entries;
+        heap->capacity *= 2;
+    }
+    j = heap->size++;
+    heap->entries[j].product = x;
+    heap->entries[j].key = key;
+    heap->entries[j].whole = whole;
+
+    /* sift up */
+    while (j > 0)
+    {
+        a = heapKey(heap->entries[j]);
+        b = heapKey(heap->entries[(j-1) / 2]);
+        if (compareProducts(a->time, a->quality, b->time, b->quality) >= 0) break;
+        temp = heap->entries[j];
+        heap->entries[j] = heap->entries[(j-1) / 2];
+        heap->entries[(j-1) / 2] = temp;
+        j = (j-1) / 2;
+    }
+    return 1;
+}
+
+/* pops the entry with the minimum product from a non empty heap (O(logn)) */
+HeapEntry heapPop(ProductHeap* heap)
+{
+    HeapEntry top, temp;
+    Product *a, *b;
+    int j, child;
+
+    top = heap->entries[0];
+    heap->entries[0] = heap->entries[--heap->size];
+
+    /* sift down */
+    j = 0;
+    while (2*j + 1 < heap->size)
+    {
+        child = 2*j + 1;
+        a = heapKey(heap->entries[child]);
+        if (child + 1 < heap->size)
+        {
+            b = heapKey(heap->entries[child + 1]);
+            if (compareProducts(b->time, b->quality, a->time, a->quality) < 0)
+            {
+                child++;
+                a = b;
+            }
+        }
+        b = heapKey(heap->entries[j]);
+        if (compareProducts(b->time, b->quality, a->time, a->quality) <= 0) break;
+        temp = heap->entries[j];
+        heap->entries[j] = heap->entries[child];
+        heap->entries[child] = temp;
+        j = child;
+    }
+    return top;
+}
+
+/* fills heap with the O(logn) products and subtrees covering times between left and right (O(log^2n)) */
+void heapInitRange(ProductHeap* heap, Product* root, TimeType left, TimeType right)
+{
+    Product *x;
+
+    heap->size = 0;
+    heap->failed = 0;
+    heap->capacity = 64;
+    heap->entries = (HeapEntry*)malloc(heap->capacity * sizeof(HeapEntry));
+    if (heap->entries == NULL)
+    {
+        heap->capacity = 0;
+        heap->failed = 1;
+        return;
+    }
+
+    /* find the first product in range - the paths to left and right split there */
+    while (root != NULL && !isInRange(root, left, right) && READ_STEP()) root = (root->time < left ? root->right : root->left);
+    if (root == NULL) return;
+    heapPush(heap, root, 0);
+
+    /* path to left - right subtrees of products in range are all in range */
+    for (x = root->left; x != NULL && READ_STEP(); )
+    {
+        if (x->time >= left)
+        {
+            heapPush(heap, x, 0);
+            heapPush(heap, x->right, 1);
+            x = x->left;
+        }
+        else x = x->right;
+    }
+
+    /* path to right - left subtrees of products in range are all in range */
+    for (x = root->right; x != NULL && READ_STEP(); )
+    {
+        if (x->time <= right)
+        {
+            heapPush(heap, x, 0);
+            heapPush(heap, x->left, 1);
+            x = x->right;
+        }
+        else x = x->left;
+    }
+}
+
+/* pops the next minimum quality product from heap, NULL if empty (O(logn * log(heap))) */
+Product* nextMinQuality(ProductHeap* heap)
+{
+    HeapEntry top;
+    Product *x;
+
+    while (heap->size > 0 && READ_STEP())
+    {
+        top = heapPop(heap);
+        x = top.product;
+        if (!top.whole) return x;
+
+        /* subtree root is the minimum - the rest of subtree is its children */
+        if (top.key == x)
+        {
+            heapPush(heap, x->left, 1);
+            heapPush(heap, x->right, 1);
+            return x;
+        }
+        /* minimum is deeper - split subtree to its root and its children */
+        heapPush(heap, x, 0);
+        heapPush(heap, x->left, 1);
+        heapPush(heap, x->right, 1);
+    }
+    return NULL;
+}
+
+/* returns how many tree products are between left and right (O(logn)) */
+int rangeCount(DataStructure* ds, TimeType left, TimeType right)
+{
+#ifdef BUCKET_TIME_INDEX
+    if (left > right) return 0;
+    return bucketCountUpTo(ds->bucketRoot, right, 1) - bucketCountUpTo(ds->bucketRoot, left, 0);
+#else
+    return countProducts(ds->timeRoot, left, right);
+#endif
+}
+
+/* finds the minimum quality tree product between left and right, returns 1 if found, 0 otherwise (O(logn)) */
+int rangeMin(DataStructure* ds, TimeType left, TimeType right, TimeType* time, QualityType* quality)
+{
+#ifdef BUCKET_TIME_INDEX
+    return bucketMinBetween(ds->bucketRoot, left, right, 0, 0, time, quality);
+#else
+    Product* x = findMinQualityBetween(ds->timeRoot, left, right);
+    if (x == NULL) return 0;
+    *time = x->time;
+    *quality = x->quality;
+    return 1;
+#endif
+}
+
+/* fills heap with the O(logn) pieces covering tree products between left and right (O(log^2n)) */
+void rangeHeapInit(RangeHeap* heap, DataStructure* ds, TimeType left, TimeType right)
+{
+#ifdef BUCKET_TIME_INDEX
+    heap->size = 0;
+    heap->failed = 0;
+    heap->capacity = 64;
+    heap->entries = (BucketEntry*)malloc(heap->capacity * sizeof(BucketEntry));
+    if (heap->entries == NULL)
+    {
+        heap->capacity = 0;
+        heap->failed = 1;
+        return;
+    }
+    bucketPushRange(heap, ds->bucketRoot, left, right, 0, 0);
+#else
+    heapInitRange(heap, ds->timeRoot, left, right);
+#endif
+}
+
+/* pops the next minimum quality tree product from heap, returns 0 if empty (O(logn * log(heap))) */
+int rangeHeapNext(RangeHeap* heap, TimeType* time, QualityType* quality)
+{
+#ifdef BUCKET_TIME_INDEX
+    BucketEntry top;
+    BucketNode* x;
+
+    while (heap->size > 0)
+    {
+        top = bucketHeapPop(heap);
+        x = top.node;
+
+        /* whole subtree - split to its children */
+        if (x->bucket == NULL)
+        {
+            bucketHeapPush(heap, x->left, 0, x->left->subtreeSize - 1);
+            bucketHeapPush(heap, x->right, 0, x->right->subtreeSize - 1);
+            continue;
+        }
+        /* leaf range - the rest of range is on both sides of its minimum */
+        bucketHeapPush(heap, x, top.lo, top.index - 1);
+        bucketHeapPush(heap, x, top.index + 1, top.hi);
+        *time = top.time;
+        *quality = top.quality;
+        return 1;
+    }
+    return 0;
+#else
+    Product* x = nextMinQuality(heap);
+    if (x == NULL) return 0;
+    *time = x->time;
+    *quality = x->quality;
+    return 1;
+#endif
+}
+
+#ifdef QUALITY_SKETCH
+
+/* returns time bucket of time, rounded down for negative times (O(1)) */
+TimeType timeBucket(TimeType time)
+{
+    if (time >= 0) return time / SKETCH_WIDTH;
+    return -((-(time + 1)) / SKETCH_WIDTH) - 1;
+}
+
+/* returns log-linear bin of quality - small magnitudes get a bin each, bigger ones 2^SKETCH_PRECISION bins per power of 2,
+   negative qualities get negative bins so bins keep qualities' order (O(1)) */
+int qualityBin(QualityType quality)
+{
+    unsigned long long magnitude;
+    int shift, bin;
+
+    magnitude = (quality < 0 ? (unsigned long long)(-(quality + 1)) + 1 : (unsigned long long)quality);
+    if (magnitude < (2ULL << SKETCH_PRECISION)) bin = (int)magnitude;
+    else
+    {
+        shift = 63 - __builtin_clzll(magnitude) - SKETCH_PRECISION;
+        bin = (shift << SKETCH_PRECISION) + (int)(magnitude >> shift);
+    }
+    return (quality < 0 ? -bin - 1 : bin);
+}
+
+/* returns quality in the middle of bin, or at its low end if the middle does not fit in QualityType (O(1)) */
+QualityType binQuality(int bin)
+{
+    unsigned long long low, half = 0, largest;
+    int shift, negative = (bin < 0);
+
+    if (negative) bin = -bin - 1;
+    if (bin < (2 << SKETCH_PRECISION)) low = bin;
+    else
+    {
+        shift = (bin >> SKETCH_PRECISION) - 1;
+        low = (unsigned long long)(bin - (shift << SKETCH_PRECISION)) << shift;
+        half = (1ULL << shift) >> 1;
+    }
+    if (!negative) return (QualityType)(low + half);
+
+    /* most negative quality's bin goes past smallest quality */
+    largest = ((unsigned long long)(((QualityType)1 << (sizeof(QualityType) * 8 - 2)) - 1) << 1) + 1;
+    if (low + half - 1 > largest) half = 0;
+    return -(QualityType)(low + half - 1) - 1;
+}
+
+/* returns index of bucket's sketch, or where it would be inserted (O(log buckets)) */
+int sketchIndex(DataStructure* ds, TimeType bucket)
+{
+    int low = 0, high = ds->sketchCount, middle;
+    while (low < high)
+    {
+        middle = (low + high) / 2;
+        if (ds->sketches[middle].bucket < bucket) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+/* returns index of bucket's sketch, creating an empty one if create is 1, -1 if there is none (O(buckets)) */
+int sketchFind(DataStructure* ds, TimeType bucket, int create)
+{
+    QualitySketch* grown;
+    int index = sketchIndex(ds, bucket);
+
+    /* new bucket */
+    if (index == ds->sketchCount || ds->sketches[index].bucket != bucket)
+    {
+        if (!create) return -1;
+        if (ds->sketchCount == ds->sketchCapacity)
+        {
+            grown = (QualitySketch*)realloc(ds->sketches, max(2 * ds->sketchCapacity, 4) * sizeof(QualitySketch));
+            if (grown == NULL) return -1;
+            ds->sketches = grown;
+            ds->sketchCapacity = max(2 * ds->sketchCapacity, 4);
+        }
+        memmove(ds->sketches + index + 1, ds->sketches + index, (ds->sketchCount - index) * sizeof(QualitySketch));
+        ds->sketchCount++;
+        ds->sketches[index].bucket = bucket;
+        ds->sketches[index].count = 0;
+        ds->sketches[index].size = 0;
+        ds->sketches[index].capacity = 0;
+        ds->sketches[index].bins = NULL;
+        ds->sketches[index].counts = NULL;
+    }
+    return index;
+}
+
+/* adds count products (negative to remove) of quality to time's bucket sketch, empty sketches are dropped (O(buckets + bins)) */
+void sketchAdd(DataStructure* ds, TimeType time, QualityType quality, int count)
+{
+    int index = sketchFind(ds, timeBucket(time), count > 0);
+    if (index >= 0) sketchBinAdd(ds, index, qualityBin(quality), count);
+}
+
+/* adds count products to bin of sketch at index, sketch is dropped when it gets empty (O(buckets + bins)) */
+void sketchBinAdd(DataStructure* ds, int index, int bin, int count)
+{
+    QualitySketch* sketch = &ds->sketches[index];
+    int *bins, *counts, low = 0, high = sketch->size, middle;
+
+    /* find bin */
+    while (low < high)
+    {
+        middle = (low + high) / 2;
+        if (sketch->bins[middle] < bin) low = middle + 1;
+        else high = middle;
+    }
+
+    /* new bin */
+    if (low == sketch->size || sketch->bins[low] != bin)
+    {
+        if (count < 0) return;
+        if (sketch->size == sketch->capacity)
+        {
+            bins = (int*)realloc(sketch->bins, max(2 * sketch->capacity, 4) * sizeof(int));
+            if (bins == NULL) return;
+            sketch->bins = bins;
+            counts = (int*)realloc(sketch->counts, max(2 * sketch->capacity, 4) * sizeof(int));
+            if (counts == NULL) return;
+            sketch->counts = counts;
+            sketch->capacity = max(2 * sketch->capacity, 4);
+        }
+        memmove(sketch->bins + low + 1, sketch->bins + low, (sketch->size - low) * sizeof(int));
+        memmove(sketch->counts + low + 1, sketch->counts + low, (sketch->size - low) * sizeof(int));
+        sketch->size++;
+        sketch->bins[low] = bin;
+        sketch->counts[low] = 0;
+    }
+    sketch->counts[low] += count;
+    sketch->count += count;
+
+    /* drop empty bin and empty sketch */
+    if (sketch->counts[low] == 0)
+    {
+        sketch->size--;
+        memmove(sketch->bins + low, sketch->bins + low + 1, (sketch->size - low) * sizeof(int));
+        memmove(sketch->counts + low, sketch->counts + low + 1, (sketch->size - low) * sizeof(int));
+    }
+    if (sketch->count == 0)
+    {
+        free(sketch->bins);
+        free(sketch->counts);
+        ds->sketchCount--;
+        memmove(ds->sketches + index, ds->sketches + index + 1, (ds->sketchCount - index) * sizeof(QualitySketch));
+    }
+}
+
+/* adds src's sketches to dst's and frees them (O(buckets * bins)) */
+void sketchMerge(DataStructure* dst, DataStructure* src)
+{
+    QualitySketch* sketch;
+    int j, k, index;
+
+    for (j = 0; j < src->sketchCount; j++)
+    {
+        sketch = &src->sketches[j];
+        index = sketchFind(dst, sketch->bucket, 1);
+        if (index < 0) continue;
+        for (k = 0; k < sketch->size; k++) sketchBinAdd(dst, index, sketch->bins[k], sketch->counts[k]);
+    }
+    freeSketches(src);
+}
+
+/* frees all sketches (O(buckets)) */
+void freeSketches(DataStructure* ds)
+{
+    int j;
+    for (j = 0; j < ds->sketchCount; j++)
+    {
+        free(ds->sketches[j].bins);
+        free(ds->sketches[j].counts);
+    }
+    free(ds->sketches);
+    ds->sketches = NULL;
+    ds->sketchCount = 0;
+    ds->sketchCapacity = 0;
+}
+
+#endif
+
+#ifdef ONLINE_COMPACTION
+
+/* allocates a product from the filling compaction block, a new block for capacity products is started when it is full (O(1)) */
+Product* compactAlloc(DataStructure* ds, int capacity, CompactionReport* report)
+{
+    CompactBlock* block = ds->compactBlock;
+
+    if (block == NULL || block->used == block->capacity)
+    {
+        capacity = min(max(capacity, COMPACT_MIN_BLOCK), COMPACT_MAX_BLOCK);
+        compactClose(ds);
+
+        block = (CompactBlock*)malloc(sizeof(CompactBlock) + capacity * sizeof(Product));
+        if (block == NULL) return NULL;
+        block->capacity = capacity;
+        block->used = 0;
+        block->live = 0;
+        block->filling = 1;
+        ds->compactBlock = block;
+        if (report) report->blockBytes += sizeof(CompactBlock) + capacity * sizeof(Product);
+    }
+    block->live++;
+    return &block->products[block->used++];
+}
+
+/* releases compacted product x from its block, returns bytes freed (block's bytes if it was emptied, else 0) (O(1)) */
+long compactRelease(Product* x)
+{
+    CompactBlock* block = x->block;
+    long bytes;
+
+    /* last product of a block that is no longer filled frees it */
+    if (--block->live > 0 || block->filling) return 0;
+    bytes = sizeof(CompactBlock) + block->capacity * sizeof(Product);
+    free(block);
+    return bytes;
+}
+
+/* stops filling current compaction block, frees it if all its products were freed (O(1)) */
+void compactClose(DataStructure* ds)
+{
+    CompactBlock* block = ds->compactBlock;
+    if (block == NULL) return;
+
+    block->filling = 0;
+    ds->compactBlock = NULL;
+    if (block->live == 0) free(block);
+}
+
+/* frees filling compaction block after all products were freed, and drops the pass in progress (O(1)) */
+void freeCompactBlocks(DataStructure* ds)
+{
+    compactClose(ds);
+    ds->compactPhase = 0;
+    ds->compactStep = 0;
+}
+
+/* moves x to filling compaction block and fixes all pointers to it, root is the tree root x is in, returns x's new address (O(logn)) */
+Product* relocateProduct(DataStructure* ds, Product* x, Product** root, int capacity, CompactionReport* report)
+{
+    Product *y, *z;
+    long released;
+
+    /* already moved in this pass */
+    if (x->block != NULL && x->block == ds->compactBlock) return x;
+
+    y = compactAlloc(ds, capacity, report);
+    if (y == NULL) return x;        /* x stays */
+    *y = *x;
+    y->block = ds->compactBlock;
+
+    /* parent or root */
+    if (y->parent == NULL) *root = y;
+    else if (y->parent->left == x) y->parent->left = y;
+    else y->parent->right = y;
+
+    /* children and twin */
+    if (y->left) y->left->parent = y;
+    if (y->right) y->right->parent = y;
+    if (y->twin) y->twin->twin = y;
+
+    /* minimum pointers - only x and a path of its ancestors can point to x */
+    if (y->minQualityP == x) y->minQualityP = y;
+    for (z = y->parent; z != NULL && z->minQualityP == x; z = z->parent) z->minQualityP = y;
+
+    /* free old place */
+    if (x->block != NULL) released = compactRelease(x);
+    else
+    {
+        freeProduct(ds->pool, x);
+        released = sizeof(Product);
+    }
+    if (report)
+    {
+        report->moved++;
+        report->releasedBytes += released;
+    }
+    return y;
+}
+
+/* returns next product in order of x's tree, using parent pointers (amortized O(1)) */
+Product* successorProduct(Product* x)
+{
+    if (x->right != NULL) return minProduct(x->right);
+    while (x->parent != NULL && x->parent->right == x) x = x->parent;
+    return x->parent;
+}
+
+/* returns product with the smallest time bigger than time, NULL if none (O(logn)) */
+Product* timeAfter(Product* root, TimeType time)
+{
+    Product* successor = NULL;
+    while (root != NULL)
+    {
+        if (root->time > time)
+        {
+            successor = root;
+            root = root->left;
+        }
+        else root = root->right;
+    }
+    return successor;
+}
+
+/* returns quality node with the smallest quality bigger than quality, or equal if inclusive, NULL if none (O(logn)) */
+Product* qualityAfter(Product* root, QualityType quality, int inclusive)
+{
+    Product* successor = NULL;
+    while (root != NULL)
+    {
+        if (root->quality > quality || (inclusive && root->quality == quality))
+        {
+            successor = root;
+            root = root->left;
+        }
+        else root = root->right;
+    }
+    return successor;
+}
+
+#endif
+
+#ifdef LAZY_DELETE
+
+/* marks time tree product x and its quality tree twin as tombstones, fixing sizes and minimums up to the roots (O(logn)) */
+void tombstoneProduct(DataStructure* ds, Product* x)
+{
+    Product* y;
+
+    x->dead = 1;
+    x->twin->dead = 1;
+
+    /* path to time tree root, and path to time subtree root in quality tree */
+    for (y = x; y != NULL; y = y->parent)
+    {
+        y->subtreeSize--;
+        updateMinQuality(y);
+    }
+    for (y = x->twin; y != NULL; y = y->parent)
+    {
+        y->subtreeSize--;
+        updateMinQuality(y);
+    }
+
+    /* quality node's path to quality tree root */
+    for (y = searchQuality(ds->qualityRoot, x->quality); y != NULL; y = y->parent) y->subtreeSize--;
+    ds->tombstones++;
+}
+
+/* removes tombstone x of time tree and its twin from both trees (O(logn)) */
+void removeTombstone(DataStructure* ds, Product* x)
+{
+    TimeType time = x->time;
+    QualityType quality = x->quality;
+
+    ds->timeRoot = removeProductFromTime(ds->pool, ds->timeRoot, time);
+    ds->qualityRoot = removeProductFromQuality(ds->pool, ds->qualityRoot, time, quality);
+    ds->tombstones--;
+}
+
+/* returns 1 if more than TOMBSTONE_PERCENT of tree products are tombstones (O(1)) */
+int tombstonesDue(DataStructure* ds)
+{
+    long live = (ds->timeRoot ? ds->timeRoot->subtreeSize : 0);
+    return ((long)ds->tombstones * 100 > (long)TOMBSTONE_PERCENT * (live + ds->tombstones));
+}
+
+/* adds live products of a time tree to nodes from count in time order and frees its tombstones, returns new count (O(n)) */
+int collectLive(MemoryPool* pool, Product* root, Product** nodes, int count)
+{
+    Product* right;
+
+    if (root == NULL) return count;
+    right = root->right;
+    count = collectLive(pool, root->left, nodes, count);
+    if (root->dead) freeProduct(pool, root);
+    else nodes[count++] = root;
+    return collectLive(pool, right, nodes, count);
+}
+
+/* rebuilds time subtrees of a quality tree from their live products, adds non empty quality nodes to qualities from count
+   in quality order and frees the others, returns new count (O(n)) */
+int purgeQualities(MemoryPool* pool, Product* root, Product** qualities, int count, Product** nodes)
+{
+    Product* right;
+    int size;
+
+    if (root == NULL) return count;
+    right = root->right;
+    count = purgeQualities(pool, root->left, qualities, count, nodes);
+
+    size = collectLive(pool, root->timeSubtree, nodes, 0);
+    root->timeSubtree = buildBalanced(nodes, 0, size - 1);
+    if (root->timeSubtree == NULL) freeProduct(pool, root);
+    else qualities[count++] = root;
+    return purgeQualities(pool, right, qualities, count, nodes);
+}
+
+/* builds a balanced tree of sorted nodes lo to hi and returns its root, valid for AVL and WAVL (O(hi - lo)) */
+Product* buildBalanced(Product** nodes, int lo, int hi)
+{
+    int mid;
+
+    if (lo > hi) return NULL;
+    mid = lo + (hi - lo) / 2;
+    return joinNode(buildBalanced(nodes, lo, mid - 1), nodes[mid], buildBalanced(nodes, mid + 1, hi));
+}
+
+#endif
+
+/* returns how many products in quality tree have quality smaller than quality, or smaller or equal if inclusive (O(logn)) */
+int countQualities(Product* qualityRoot, QualityType quality, int inclusive)
+{
+    int counter = 0;
+    while (qualityRoot != NULL)
+    {
+        if (quality < qualityRoot->quality || (!inclusive && quality == qualityRoot->quality)) qualityRoot = qualityRoot->left;
+        else
+        {
+            counter += (qualityRoot->left ? qualityRoot->left->subtreeSize : 0) + timeSubtreeSize(qualityRoot);
+            qualityRoot = qualityRoot->right;
+        }
+    }
+    return counter;
+}
+
+/* returns how many tree products between left and right have quality smaller than quality, or smaller or equal if inclusive */
+int boxCount(DataStructure* ds, TimeType left, TimeType right, QualityType quality, int inclusive)
+{
+    if (left > right) return 0;
+#ifdef DOMINANCE_INDEX
+    return dominanceCount(ds->dominanceRoot, left, right, 0, 0, quality, inclusive);    /* O(log^2n) */
+#else
+    return qualityBoxCount(ds->qualityRoot, left, right, quality, inclusive);          /* O(klogn) for k qualities */
+#endif
+}
+
+/* returns how many write buffer products between left and right have quality smaller than quality, or smaller or equal if inclusive (O(capacity)) */
+int bufferBoxCount(DataStructure* ds, TimeType left, TimeType right, QualityType quality, int inclusive)
+{
+    int counter = 0, k;
+    for (k = 0; k < ds->bufferSize; k++)
+    {
+        if (ds->bufferQuality[k] > quality || (!inclusive && ds->bufferQuality[k] == quality)) break;    /* buffer is sorted by quality */
+        if (ds->bufferTime[k] >= left && ds->bufferTime[k] <= right) counter++;
+    }
+    return counter;
+}
+
+#ifdef DOMINANCE_INDEX
+
+/* inserts a product to dominance index and returns new root, unbalanced subtrees are rebuilt (amortized O(log^2n)) */
+DominanceNode* dominanceInsert(DominanceNode* root, TimeType time, QualityType quality, int* removed)
+{
+    DominanceNode *child;
+
+    /* new leaf */
+    if (root == NULL)
+    {
+        root = (DominanceNode*)malloc(sizeof(DominanceNode));
+        if (root == NULL) return NULL;
+        root->left = NULL;
+        root->right = NULL;
+        root->time = time;
+        root->quality = quality;
+        root->removed = 0;
+        root->size = 1;
+        root->qualities = insertQuality(NULL, NULL, creatNewProduct(NULL, time, quality));
+        return root;
+    }
+    /* product is in subtree */
+    root->qualities = insertQuality(NULL, root->qualities, creatNewProduct(NULL, time, quality));
+
+    /* removed product with same time - reuse its node */
+    if (time == root->time)
+    {
+        root->quality = quality;
+        root->removed = 0;
+        (*removed)--;
+        return root;
+    }
+    /* insert to subtree */
+    if (time < root->time)
+    {
+        child = dominanceInsert(root->left, time, quality, removed);
+        if (child != NULL) root->left = child;
+    }
+    else
+    {
+        child = dominanceInsert(root->right, time, quality, removed);
+        if (child != NULL) root->right = child;
+    }
+    root->size = 1 + (root->left ? root->left->size : 0) + (root->right ? root->right->size : 0);
+
+    /* child holds too many nodes - rebuild subtree */
+    if (10 * max(root->left ? root->left->size : 0, root->right ? root->right->size : 0) > DOMINANCE_BALANCE * root->size)
+    {
+        return dominanceRebuild(root, removed);
+    }
+    return root;
+}
+
+/* removes an existing product from dominance index, node is marked removed and the index is rebuilt when most nodes are removed (amortized O(log^2n)) */
+DominanceNode* dominanceRemove(DominanceNode* root, TimeType time, QualityType quality, int* removed)
+{
+    DominanceNode* x;
+
+    for (x = root; x != NULL; x = (time < x->time ? x->left : x->right))
+    {
+        x->qualities = removeProductFromQuality(NULL, x->qualities, time, quality);
+        if (x->time == time)
+        {
+            x->removed = 1;
+            (*removed)++;
+            break;
+        }
+    }
+
+    /* more removed nodes than products - rebuild the whole index */
+    if (root != NULL && 2 * (*removed) > root->size)
+    {
+        return dominanceRebuild(root, removed);
+    }
+    return root;
+}
+
+/* inserts src time tree products with times not in dst time tree to dominance index, returns new root (O(mlog^2n)) */
+DominanceNode* dominanceMerge(DominanceNode* root, Product* dstTimes, Product* srcTimes, int* removed)
+{
+    Product* x;
+    if (srcTimes == NULL) return root;
+
+    x = searchTime(dstTimes, srcTimes->time);
+    if (x == NULL || x->time != srcTimes->time) root = dominanceInsert(root, srcTimes->time, srcTimes->quality, removed);
+    root = dominanceMerge(root, dstTimes, srcTimes->left, removed);
+    return dominanceMerge(root, dstTimes, srcTimes->right, removed);
+}
+
+/* rebuilds a subtree perfectly balanced without its removed nodes, returns new subtree (O(klog^2k)) */
+DominanceNode* dominanceRebuild(DominanceNode* root, int* removed)
+{
+    DominanceNode** nodes;
+    int count;
+
+    nodes = (DominanceNode**)malloc(root->size * sizeof(DominanceNode*));
+    if (nodes == NULL) return root;     /* keep unbalanced subtree */
+
+    /* collect products in time order, free removed nodes and all quality trees */
+    count = dominanceCollect(root, nodes, 0, removed);
+    root = dominanceBuild(nodes, 0, count - 1);
+    free(nodes);
+    return root;
+}
+
+/* adds subtree's products to nodes in time order from index count and frees removed nodes, returns new count (O(klogk)) */
+int dominanceCollect(DominanceNode* root, DominanceNode** nodes, int count, int* removed)
+{
+    DominanceNode* right;
+    if (root == NULL) return count;
+
+    count = dominanceCollect(root->left, nodes, count, removed);
+    right = root->right;
+    freeQualityTree(NULL, root->qualities);
+    if (root->removed)
+    {
+        free(root);
+        (*removed)--;
+    }
+    else nodes[count++] = root;
+    return dominanceCollect(right, nodes, count, removed);
+}
+
+/* builds a balanced subtree of nodes lo to hi with their quality trees, returns its root (O(klog^2k)) */
+DominanceNode* dominanceBuild(DominanceNode** nodes, int lo, int hi)
+{
+    DominanceNode* root;
+    int mid, j;
+
+    if (lo > hi) return NULL;
+    mid = (lo + hi) / 2;
+    root = nodes[mid];
+    root->left = dominanceBuild(nodes, lo, mid - 1);
+    root->right = dominanceBuild(nodes, mid + 1, hi);
+    root->size = hi - lo + 1;
+
+    /* quality tree of all subtree's products */
+    root->qualities = NULL;
+    for (j = lo; j <= hi; j++) root->qualities = insertQuality(NULL, root->qualities, creatNewProduct(NULL, nodes[j]->time, nodes[j]->quality));
+    return root;
+}
+
+/* frees dominance index (O(nlogn)) */
+void freeDominance(DominanceNode* root)
+{
+    if (root == NULL) return;
+    freeDominance(root->left);
+    freeDominance(root->right);
+    freeQualityTree(NULL, root->qualities);
+    free(root);
+}
+
+/* counts products between left and right with quality smaller than quality, or smaller or equal if inclusive, open sides are unbounded (O(log^2n)) */
+int dominanceCount(DominanceNode* x, TimeType left, TimeType right, int openLeft, int openRight, QualityType quality, int inclusive)
+{
+    int counter;
+
+    if (x == NULL) return 0;
+
+    /* whole subtree in range */
+    if (openLeft && openRight) return countQualities(x->qualities, quality, inclusive);
+
+    /* range is in one subtree */
+    if (!openLeft && x->time < left) return dominanceCount(x->right, left, right, 0, openRight, quality, inclusive);
+    if (!openRight && x->time > right) return dominanceCount(x->left, left, right, openLeft, 0, quality, inclusive);
+
+    /* range splits at x - left part is open on the right and right part is open on the left */
+    counter = (!x->removed && (x->quality < quality || (inclusive && x->quality == quality)));
+    counter += dominanceCount(x->left, left, right, openLeft, 1, quality, inclusive);
+    counter += dominanceCount(x->right, left, right, 1, openRight, quality, inclusive);
+    return counter;
+}
+
+#else
+
+/* counts products between left and right with quality smaller than quality, or smaller or equal if inclusive (O(klogn) for k qualities) */
+int qualityBoxCount(Product* qualityRoot, TimeType left, TimeType right, QualityType quality, int inclusive)
+{
+    int counter = 0;
+    while (qualityRoot != NULL && READ_STEP())
+    {
+        if (quality < qualityRoot->quality || (!inclusive && quality == qualityRoot->quality)) qualityRoot = qualityRoot->left;
+        else
+        {
+            /* all qualities of left subtree and this quality are counted */
+            counter += qualityBoxCount(qualityRoot->left, left, right, qualityRoot->quality, 0);
+            counter += countProducts(qualityRoot->timeSubtree, left, right);
+            qualityRoot = qualityRoot->right;
+        }
+    }
+    return counter;
+}
+
+#endif
+
+#ifdef BUCKET_TIME_INDEX
+
+/* returns how many of n sorted times are smaller than time, or smaller or equal if inclusive (O(BUCKET_SIZE)) */
+int bucketCountTimes(const TimeType* times, int n, TimeType time, int inclusive)
+{
+    int counter = 0, j = 0;
+#ifdef VECTOR_LANES
+    BucketVector key = VECTOR_SET(time);
+    BucketVector bigger;
+
+    /* compare VECTOR_LANES times at once, count lanes by mask bits */
+    for (; j + VECTOR_LANES <= n; j += VECTOR_LANES)
+    {
+        if (inclusive)
+        {
+            bigger = VECTOR_GREATER(VECTOR_LOAD(times + j), key);
+            counter += VECTOR_LANES - __builtin_popcount(VECTOR_MASK(bigger));
+        }
+        else counter += __builtin_popcount(VECTOR_MASK(VECTOR_GREATER(key, VECTOR_LOAD(times + j))));
+    }
+#endif
+    for (; j < n; j++) counter += (inclusive ? times[j] <= time : times[j] < time);
+    return counter;
+}
+
+/* returns index of first minimum quality between lo and hi - smallest time of them, since times are sorted (O(BUCKET_SIZE)) */
+int bucketMinIndex(const QualityType* qualities, int lo, int hi)
+{
+    QualityType best = qualities[lo];
+    int j = lo + 1, index = lo;
+#ifdef VECTOR_LANES
+    QualityType lanes[VECTOR_LANES];
+    BucketVector minimum, key;
+    int mask;
+
+    /* minimum of VECTOR_LANES qualities at once, then of the lanes */
+    if (hi - j + 1 >= VECTOR_LANES)
+    {
+        minimum = VECTOR_SET(best);
+        for (; j + VECTOR_LANES <= hi + 1; j += VECTOR_LANES) minimum = VECTOR_MIN(minimum, VECTOR_LOAD(qualities + j));
+        VECTOR_STORE(lanes, minimum);
+        for (mask = 0; mask < VECTOR_LANES; mask++) best = min(best, lanes[mask]);
+    }
+#endif
+    for (; j <= hi; j++) best = min(best, qualities[j]);
+
+#ifdef VECTOR_LANES
+    /* first lane equal to minimum */
+    key = VECTOR_SET(best);
+    for (; index + VECTOR_LANES <= hi + 1; index += VECTOR_LANES)
+    {
+        mask = VECTOR_MASK(VECTOR_EQUAL(VECTOR_LOAD(qualities + index), key));
+        if (mask) return index + __builtin_ctz(mask);
+    }
+#endif
+    while (qualities[index] != best) index++;
+    return index;
+}
+
+/* creates an empty leaf bucket, NULL on failure (O(1)) */
+BucketNode* createBucket(void)
+{
+    /* node and its bucket in one allocation */
+    BucketNode* x = (BucketNode*)malloc(sizeof(BucketNode) + sizeof(Bucket));
+    if (x == NULL) return NULL;
+    x->left = NULL;
+    x->right = NULL;
+    x->bucket = (Bucket*)(x + 1);
+    x->bucket->count = 0;
+    x->height = 0;
+    x->subtreeSize = 0;
+    return x;
+}
+
+/* updates height, subtree size and minimum of x from its children or its bucket (O(BUCKET_SIZE)) */
+void updateBucketNode(BucketNode* x)
+{
+    Bucket* b = x->bucket;
+    int index;
+
+    /* leaf - minimum of its bucket */
+    if (b != NULL)
+    {
+        x->height = 0;
+        x->subtreeSize = b->count;
+        if (b->count == 0) return;
+        index = bucketMinIndex(b->qualities, 0, b->count - 1);
+        x->minTime = b->times[index];
+        x->minQuality = b->qualities[index];
+        return;
+    }
+    /* internal node - minimum of its children */
+    x->height = max(x->left->height, x->right->height) + 1;
+    x->subtreeSize = x->left->subtreeSize + x->right->subtreeSize;
+    if (compareProducts(x->left->minTime, x->left->minQuality, x->right->minTime, x->right->minQuality) < 0)
+    {
+        x->minTime = x->left->minTime;
+        x->minQuality = x->left->minQuality;
+    }
+    else
+    {
+        x->minTime = x->right->minTime;
+        x->minQuality = x->right->minQuality;
+    }
+}
+
+/* bucket index right rotation (O(1)) */
+BucketNode* bucketRotateRight(BucketNode* x)
+{
+    BucketNode* y = x->left;
+    x->left = y->right;
+    y->right = x;
+    updateBucketNode(x);
+    updateBucketNode(y);
+    return y;
+}
+
+/* bucket index left rotation (O(1)) */
+BucketNode* bucketRotateLeft(BucketNode* x)
+{
+    BucketNode* y = x->right;
+    x->right = y->left;
+    y->left = x;
+    updateBucketNode(x);
+    updateBucketNode(y);
+    return y;
+}
+
+/* balance bucket index node by AVL rules and return new root (O(1)) */
+BucketNode* balanceBucket(BucketNode* x)
+{
+    /* leaves and balanced nodes */
+    if (x->bucket != NULL || abs(x->left->height - x->right->height) <= 1) return x;
+
+    /* if x is left heavy */
+    if (x->left->height > x->right->height)
+    {
+        if (x->left->bucket == NULL && x->left->left->height < x->left->right->height) x->left = bucketRotateLeft(x->left);
+        return bucketRotateRight(x);
+    }
+    /* if x is right heavy */
+    if (x->right->bucket == NULL && x->right->left->height > x->right->right->height) x->right = bucketRotateRight(x->right);
+    return bucketRotateLeft(x);
+}
+
+/* inserts a product to bucket index and returns new root, existing times are kept (O(logn + BUCKET_SIZE)) */
+BucketNode* bucketInsert(BucketNode* root, TimeType time, QualityType quality)
+{
+    BucketNode* x;
+
+    /* first product - create a leaf */
+    if (root == NULL)
+    {
+        root = createBucket();
+        if (root == NULL) return NULL;
+    }
+    if (root->bucket != NULL) return bucketInsertLeaf(root, time, quality);
+
+    /* insert to subtree by split time */
+    if (time < root->splitTime)
+    {
+        x = bucketInsert(root->left, time, quality);
+        if (x != NULL) root->left = x;
+    }
+    else
+    {
+        x = bucketInsert(root->right, time, quality);
+        if (x != NULL) root->right = x;
+    }
+    updateBucketNode(root);
+    return balanceBucket(root);
+}
+
+/* inserts a product to a leaf bucket, splitting a full bucket in two, returns new subtree (O(BUCKET_SIZE)) */
+BucketNode* bucketInsertLeaf(BucketNode* leaf, TimeType time, QualityType quality)
+{
+    BucketNode *parent, *right;
+    Bucket* b = leaf->bucket;
+    int index = bucketCountTimes(b->times, b->count, time, 0);
+
+    /* time already exists */
+    if (index < b->count && b->times[index] == time) return leaf;
+
+    /* full bucket - move upper half to a new right leaf under a new internal node */
+    if (b->count == BUCKET_SIZE)
+    {
+        right = createBucket();
+        parent = (BucketNode*)malloc(sizeof(BucketNode));
+        if (right == NULL || parent == NULL)
+        {
+            free(right);
+            free(parent);
+            return leaf;
+        }
+        right->bucket->count = BUCKET_SIZE - BUCKET_SIZE / 2;
+        memcpy(right->bucket->times, b->times + BUCKET_SIZE / 2, right->bucket->count * sizeof(TimeType));
+        memcpy(right->bucket->qualities, b->qualities + BUCKET_SIZE / 2, right->bucket->count * sizeof(QualityType));
+        b->count = BUCKET_SIZE / 2;
+
+        parent->bucket = NULL;
+        parent->left = leaf;
+        parent->right = right;
+        parent->splitTime = right->bucket->times[0];
+        if (time < parent->splitTime) bucketInsertLeaf(leaf, time, quality);
+        else bucketInsertLeaf(right, time, quality);
+        updateBucketNode(leaf);
+        updateBucketNode(right);
+        updateBucketNode(parent);
+        return parent;
+    }
+
+    /* shift bigger times one place right */
+    memmove(b->times + index + 1, b->times + index, (b->count - index) * sizeof(TimeType));
+    memmove(b->qualities + index + 1, b->qualities + index, (b->count - index) * sizeof(QualityType));
+    b->times[index] = time;
+    b->qualities[index] = quality;
+    b->count++;
+    updateBucketNode(leaf);
+    return leaf;
+}
+
+/* removes a product from bucket index and returns new root, empty leaves are removed (O(logn + BUCKET_SIZE)) */
+BucketNode* bucketRemove(BucketNode* root, TimeType time)
+{
+    BucketNode* temp;
+    Bucket *b, *other;
+    int index;
+
+    if (root == NULL) return NULL;
+
+    /* leaf - remove time from bucket */
+    if (root->bucket != NULL)
+    {
+        b = root->bucket;
+        index = bucketCountTimes(b->times, b->count, time, 0);
+        if (index == b->count || b->times[index] != time) return root;      /* product not found */
+        memmove(b->times + index, b->times + index + 1, (b->count - index - 1) * sizeof(TimeType));
+        memmove(b->qualities + index, b->qualities + index + 1, (b->count - index - 1) * sizeof(QualityType));
+        b->count--;
+        if (b->count == 0)
+        {
+            free(root);
+            return NULL;
+        }
+        updateBucketNode(root);
+        return root;
+    }
+
+    /* remove from subtree by split time */
+    if (time < root->splitTime) root->left = bucketRemove(root->left, time);
+    else root->right = bucketRemove(root->right, time);
+
+    /* a leaf was emptied - its sibling takes the node's place */
+    if (root->left == NULL || root->right == NULL)
+    {
+        temp = (root->left ? root->left : root->right);
+        free(root);
+        return temp;
+    }
+    /* two small sibling leaves - merge them to the left one */
+    b = root->left->bucket;
+    other = root->right->bucket;
+    if (b != NULL && other != NULL && b->count + other->count <= BUCKET_SIZE / 2)
+    {
+        memcpy(b->times + b->count, other->times, other->count * sizeof(TimeType));
+        memcpy(b->qualities + b->count, other->qualities, other->count * sizeof(QualityType));
+        b->count += other->count;
+        temp = root->left;
+        free(root->right);
+        free(root);
+        updateBucketNode(temp);
+        return temp;
+    }
+    updateBucketNode(root);
+    return balanceBucket(root);
+}
+
+/* inserts all products of src to dst, frees src and returns new dst root (O(mlogn)) */
+BucketNode* bucketMerge(BucketNode* dst, BucketNode* src)
+{
+    BucketNode* x;
+    int j;
+
+    if (src == NULL) return dst;
+    if (src->bucket != NULL)
+    {
+        for (j = 0; j < src->bucket->count; j++)
+        {
+            x = bucketInsert(dst, src->bucket->times[j], src->bucket->qualities[j]);
+            if (x != NULL) dst = x;
+        }
+    }
+    else
+    {
+        dst = bucketMerge(dst, src->left);
+        dst = bucketMerge(dst, src->right);
+    }
+    free(src);
+    return dst;
+}
+
+/* frees all nodes of bucket index (O(n / BUCKET_SIZE)) */
+void freeBuckets(BucketNode* root)
+{
+    if (root == NULL) return;
+    freeBuckets(root->left);
+    freeBuckets(root->right);
+    free(root);
+}
+
+/* returns how many products have time smaller than time, or smaller or equal if inclusive (O(logn + BUCKET_SIZE)) */
+int bucketCountUpTo(BucketNode* root, TimeType time, int inclusive)
+{
+    int counter = 0;
+    if (root == NULL) return 0;
+
+    while (root->bucket == NULL)
+    {
+        /* right subtree times are bigger or equal to split time */
+        if (time < root->splitTime || (!inclusive && time == root->splitTime)) root = root->left;
+        else
+        {
+            counter += root->left->subtreeSize;
+            root = root->right;
+        }
+    }
+    return counter + bucketCountTimes(root->bucket->times, root->bucket->count, time, inclusive);
+}
+
+/* finds minimum quality product with time between left and right, open sides are unbounded, returns 1 if found (O(logn + BUCKET_SIZE)) */
+int bucketMinBetween(BucketNode* x, TimeType left, TimeType right, int openLeft, int openRight, TimeType* time, QualityType* quality)
+{
+    TimeType rightTime;
+    QualityType rightQuality;
+    int lo, hi, index, found;
+
+    if (x == NULL) return 0;
+
+    /* whole subtree in range */
+    if (openLeft && openRight)
+    {
+        *time = x->minTime;
+        *quality = x->minQuality;
+        return 1;
+    }
+    /* leaf - scan the in range part of bucket */
+    if (x->bucket != NULL)
+    {
+        lo = (openLeft ? 0 : bucketCountTimes(x->bucket->times, x->bucket->count, left, 0));
+        hi = (openRight ? x->bucket->count : bucketCountTimes(x->bucket->times, x->bucket->count, right, 1)) - 1;
+        if (lo > hi) return 0;
+        index = bucketMinIndex(x->bucket->qualities, lo, hi);
+        *time = x->bucket->times[index];
+        *quality = x->bucket->qualities[index];
+        return 1;
+    }
+    /* range is in one subtree */
+    if (!openRight && right < x->splitTime) return bucketMinBetween(x->left, left, right, openLeft, 0, time, quality);
+    if (!openLeft && left >= x->splitTime) return bucketMinBetween(x->right, left, right, 0, openRight, time, quality);
+
+    /* range splits here - left part is open on the right and right part is open on the left */
+    found = bucketMinBetween(x->left, left, right, openLeft, 1, time, quality);
+    if (bucketMinBetween(x->right, left, right, 1, openRight, &rightTime, &rightQuality) &&
+        (!found || compareProducts(rightTime, rightQuality, *time, *quality) < 0))
+    {
+        *time = rightTime;
+        *quality = rightQuality;
+        found = 1;
+    }
+    return found;
+}
+
+/* pushes a whole subtree or a leaf range to heap, returns 0 if allocation failed (O(log(heap) + BUCKET_SIZE)) */
+int bucketHeapPush(BucketHeap* heap, BucketNode* x, int lo, int hi)
+{
+    BucketEntry *entries, temp;
+    int j;
+
+    if (x == NULL || lo > hi) return 1;
+
+    /* double heap capacity */
+    if (heap->size == heap->capacity)
+    {
+        entries = (BucketEntry*)realloc(heap->entries, 2 * heap->capacity * sizeof(BucketEntry));
+        if (entries == NULL)
+        {
+            heap->failed = 1;
+            return 0;
+        }
+        heap->entries = entries;
+        heap->capacity *= 2;
+    }
+    j = heap->size++;
+    heap->entries[j].node = x;
+    heap->entries[j].lo = lo;
+    heap->entries[j].hi = hi;
+
+    /* key - subtree minimum, or minimum of leaf range */
+    if (x->bucket == NULL)
+    {
+        heap->entries[j].time = x->minTime;
+        heap->entries[j].quality = x->minQuality;
+    }
+    else
+    {
+        heap->entries[j].index = bucketMinIndex(x->bucket->qualities, lo, hi);
+        heap->entries[j].time = x->bucket->times[heap->entries[j].index];
+        heap->entries[j].quality = x->bucket->qualities[heap->entries[j].index];
+    }
+
+    /* sift up */
+    while (j > 0)
+    {
+        if (compareProducts(heap->entries[j].time, heap->entries[j].quality,
+            heap->entries[(j-1) / 2].time, heap->entries[(j-1) / 2].quality) >= 0) break;
+        temp = heap->entries[j];
+        heap->entries[j] = heap->entries[(j-1) / 2];
+        heap->entries[(j-1) / 2] = temp;
+        j = (j-1) / 2;
+    }
+    return 1;
+}
+
+/* pops the entry with the minimum product from a non empty heap (O(log(heap))) */
+BucketEntry bucketHeapPop(BucketHeap* heap)
+{
+    BucketEntry top, temp;
+    int j, child;
+
+    top = heap->entries[0];
+    heap->entries[0] = heap->entries[--heap->size];
+
+    /* sift down */
+    j = 0;
+    while (2*j + 1 < heap->size)
+    {
+        child = 2*j + 1;
+        if (child + 1 < heap->size && compareProducts(heap->entries[child + 1].time, heap->entries[child + 1].quality,
+            heap->entries[child].time, heap->entries[child].quality) < 0) child++;
+        if (compareProducts(heap->entries[j].time, heap->entries[j].quality,
+            heap->entries[child].time, heap->entries[child].quality) <= 0) break;
+        temp = heap->entries[j];
+        heap->entries[j] = heap->entries[child];
+        heap->entries[child] = temp;
+        j = child;
+    }
+    return top;
+}
+
+/* pushes the O(logn) subtrees and leaf ranges covering times between left and right, open sides are unbounded (O(log^2n)) */
+void bucketPushRange(BucketHeap* heap, BucketNode* x, TimeType left, TimeType right, int openLeft, int openRight)
+{
+    int lo, hi;
+
+    if (x == NULL) return;
+
+    /* leaf - push the in range part of bucket */
+    if (x->bucket != NULL)
+    {
+        lo = (openLeft ? 0 : bucketCountTimes(x->bucket->times, x->bucket->count, left, 0));
+        hi = (openRight ? x->bucket->count : bucketCountTimes(x->bucket->times, x->bucket->count, right, 1)) - 1;
+        bucketHeapPush(heap, x, lo, hi);
+        return;
+    }
+    /* whole subtree in range */
+    if (openLeft && openRight)
+    {
+        bucketHeapPush(heap, x, 0, x->subtreeSize - 1);
+        return;
+    }
+    /* range is in one subtree */
+    if (!openRight && right < x->splitTime) bucketPushRange(heap, x->left, left, right, openLeft, 0);
+    else if (!openLeft && left >= x->splitTime) bucketPushRange(heap, x->right, left, right, 0, openRight);
+
+    /* range splits here */
+    else
+    {
+        bucketPushRange(heap, x->left, left, right, openLeft, 1);
+        bucketPushRange(heap, x->right, left, right, 1, openRight);
+    }
+}
+
+#endif
+
+/* updates subtree size from children - time subtree size for quality nodes, 1 for products, 0 for tombstones (O(1)) */
+void updateSubtreeSize(Product* x)
+{
+    x->subtreeSize = (x->timeSubtree ? timeSubtreeSize(x) : productWeight(x));
+    if (x->left) x->subtreeSize += x->left->subtreeSize;
+    if (x->right) x->subtreeSize += x->right->subtreeSize;
+}
+
+/* makes x the root of left and right, which have close heights / ranks (O(1)) */
+Product* joinNode(Product* left, Product* x, Product* right)
+{
+    x->left = left;
+    x->right = right;
+    x->parent = NULL;
+    if (left) left->parent = x;
+    if (right) right->parent = x;
+    x->height = max(nodeRank(left), nodeRank(right)) + 1;
+    updateSubtreeSize(x);
+    updateMinQuality(x);
+    return x;
+}
+
+/* joins when left is higher - go down left's right spine and rebalance on the way up (O(rank difference)) */
+Product* joinRight(Product* left, Product* x, Product* right)
+{
+    if (nodeRank(left) <= nodeRank(right) + 1) return joinNode(left, x, right);
+
+    left->right = joinRight(left->right, x, right);
+    left->right->parent = left;
+    updateSubtreeSize(left);
+    updateMinQuality(left);
+    return rebalanceInsert(left);
+}
+
+/* joins when right is higher - go down right's left spine and rebalance on the way up (O(rank difference)) */
+Product* joinLeft(Product* left, Product* x, Product* right)
+{
+    if (nodeRank(right) <= nodeRank(left) + 1) return joinNode(left, x, right);
+
+    right->left = joinLeft(left, x, right->left);
+    right->left->parent = right;
+    updateSubtreeSize(right);
+    updateMinQuality(right);
+    return rebalanceInsert(right);
+}
+
+/* joins two trees with all keys of left smaller than x and all keys of right bigger, returns new root (O(logn)) */
+Product* joinTrees(Product* left, Product* x, Product* right)
+{
+    if (nodeRank(left) > nodeRank(right) + 1) return joinRight(left, x, right);
+    if (nodeRank(right) > nodeRank(left) + 1) return joinLeft(left, x, right);
+    return joinNode(left, x, right);
+}
+
+/* splits time tree to smaller and bigger times, returns the product with time or NULL (O(logn)) */
+Product* splitTime(Product* root, TimeType time, Product** left, Product** right)
+{
+    Product *l, *r, *middle, *temp;
+
+    /* base case */
+    if (root == NULL)
+    {
+        *left = NULL;
+        *right = NULL;
+        return NULL;
+    }
+    /* detach children */
+    l = root->left;
+    r = root->right;
+    if (l) l->parent = NULL;
+    if (r) r->parent = NULL;
+
+    /* split left subtree and join its bigger part with root and right subtree */
+    if (time < root->time)
+    {
+        middle = splitTime(l, time, left, &temp);
+        *right = joinTrees(temp, root, r);
+        return middle;
+    }
+    /* split right subtree and join left subtree and root with its smaller part */
+    if (time > root->time)
+    {
+        middle = splitTime(r, time, &temp, right);
+        *left = joinTrees(l, root, temp);
+        return middle;
+    }
+    /* found time */
+    *left = l;
+    *right = r;
+    root->left = NULL;
+    root->right = NULL;
+    return root;
+}
+
+/* splits quality tree to smaller and bigger qualities, returns the quality node or NULL (O(logn)) */
+Product* splitQuality(Product* root, QualityType quality, Product** left, Product** right)
+{
+    Product *l, *r, *middle, *temp;
+
+    /* base case */
+    if (root == NULL)
+    {
+        *left = NULL;
+        *right = NULL;
+        return NULL;
+    }
+    /* detach children */
+    l = root->left;
+    r = root->right;
+    if (l) l->parent = NULL;
+    if (r) r->parent = NULL;
+
+    /* split left subtree and join its bigger part with root and right subtree */
+    if (quality < root->quality)
+    {
+        middle = splitQuality(l, quality, left, &temp);
+        *right = joinTrees(temp, root, r);
+        return middle;
+    }
+    /* split right subtree and join left subtree and root with its smaller part */
+    if (quality > root->quality)
+    {
+        middle = splitQuality(r, quality, &temp, right);
+        *left = joinTrees(l, root, temp);
+        return middle;
+    }
+    /* found quality */
+    *left = l;
+    *right = r;
+    root->left = NULL;
+    root->right = NULL;
+    return root;
+}
+
+/* merges time tree b into a, b's products with times in a are added to dropped list, returns new root (O(mlog(n/m + 1))) */
+Product* unionTimes(Product* a, Product* b, Product** dropped, int depth)
+{
+    Product *l1, *r1, *l2, *r2, *middle;
+
+    /* base case */
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+
+    /* detach a's children */
+    l1 = a->left;
+    r1 = a->right;
+    if (l1) l1->parent = NULL;
+    if (r1) r1->parent = NULL;
+
+    /* split b by a's root, a product with the same time is dropped */
+    middle = splitTime(b, a->time, &l2, &r2);
+    if (middle != NULL)
+    {
+        middle->parent = *dropped;
+        *dropped = middle;
+    }
+    return unionChildren(a, l1, r1, l2, r2, dropped, 0, depth);
+}
+
+/* merges quality tree b into a, same qualities merge their time subtrees and b's node is added to dropped, returns new root (O(mlog(n/m + 1))) */
+Product* unionQualities(Product* a, Product* b, Product** dropped, int depth)
+{
+    Product *l1, *r1, *l2, *r2, *middle;
+
+    /* base case */
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+
+    /* detach a's children */
+    l1 = a->left;
+    r1 = a->right;
+    if (l1) l1->parent = NULL;
+    if (r1) r1->parent = NULL;
+
+    /* split b by a's quality, a node with the same quality gives its time subtree to a */
+    middle = splitQuality(b, a->quality, &l2, &r2);
+    if (middle != NULL)
+    {
+        a->timeSubtree = unionTimes(a->timeSubtree, middle->timeSubtree, dropped, depth);
+        middle->parent = *dropped;
+        *dropped = middle;
+    }
+    return unionChildren(a, l1, r1, l2, r2, dropped, 1, depth);
+}
+
+/* unions left parts and right parts, in parallel for big subtrees, and joins them with a (O(mlog(n/m + 1))) */
+Product* unionChildren(Product* a, Product* l1, Product* r1, Product* l2, Product* r2, Product** dropped, int quality, int depth)
+{
+    UnionTask leftTask, rightTask;
+#ifdef PARALLEL_MERGE
+    pthread_t thread;
+    int big, forked;
+#endif
+
+    leftTask.a = l1;
+    leftTask.b = l2;
+    leftTask.dropped = NULL;
+    leftTask.quality = quality;
+    leftTask.depth = depth + 1;
+    rightTask = leftTask;
+    rightTask.a = r1;
+    rightTask.b = r2;
+
+#ifdef PARALLEL_MERGE
+    /* fork left union on a new thread if one is left, run right union on this one */
+    forked = 0;
+    big = (depth < MERGE_PARALLEL_DEPTH && a->subtreeSize + (l2 ? l2->subtreeSize : 0) + (r2 ? r2->subtreeSize : 0) >= MERGE_GRAIN);
+    if (big && __atomic_add_fetch(&mergeThreads, 1, __ATOMIC_RELAXED) <= MERGE_MAX_THREADS)
+    {
+        forked = (pthread_create(&thread, NULL, unionTask, &leftTask) == 0);
+    }
+    if (big && !forked) __atomic_sub_fetch(&mergeThreads, 1, __ATOMIC_RELAXED);     /* no thread left */
+    if (!forked) unionTask(&leftTask);
+    unionTask(&rightTask);
+    if (forked)
+    {
+        pthread_join(thread, NULL);
+        __atomic_sub_fetch(&mergeThreads, 1, __ATOMIC_RELAXED);
+    }
+#else
+    unionTask(&leftTask);
+    unionTask(&rightTask);
+#endif
+
+    /* collect dropped products of both sides */
+    appendDropped(dropped, leftTask.dropped);
+    appendDropped(dropped, rightTask.dropped);
+    return joinTrees(leftTask.result, a, rightTask.result);
+}
+
+/* adds a list of dropped products linked by parent to dropped (O(list length)) */
+void appendDropped(Product** dropped, Product* list)
+{
+    Product* last;
+    if (list == NULL) return;
+
+    for (last = list; last->parent != NULL; last = last->parent);
+    last->parent = *dropped;
+    *dropped = list;
+}
+
+/* runs a union task, thread entry point for parallel merge */
+void* unionTask(void* arg)
+{
+    UnionTask* task = (UnionTask*)arg;
+    if (task->quality) task->result = unionQualities(task->a, task->b, &task->dropped, task->depth);
+    else task->result = unionTimes(task->a, task->b, &task->dropped, task->depth);
+    return NULL;
+}
+
+#ifdef COMBINING_WRITER
+
+/* stable merge sort of count operations by time, keeps submission order of same time operations (O(klogk)) */
+CombiningOperation* sortOperations(CombiningOperation* list, int count)
+{
+    CombiningOperation *left, *right, *tail, head;
+    int j;
+
+    if (count <= 1)
+    {
+        if (list) list->next = NULL;
+        return list;
+    }
+    /* split list after count / 2 operations */
+    right = list;
+    for (j = 0; j < count / 2; j++) right = right->next;
+    left = sortOperations(list, count / 2);
+    right = sortOperations(right, count - count / 2);
+
+    /* merge, left first on equal times */
+    tail = &head;
+    while (left != NULL && right != NULL)
+    {
+        if (right->time < left->time)
+        {
+            tail->next = right;
+            right = right->next;
+        }
+        else
+        {
+            tail->next = left;
+            left = left->next;
+        }
+        tail = tail->next;
+    }
+    tail->next = (left ? left : right);
+    return head.next;
+}
+
+/* applies a batch of operations sorted by time, completes them and wakes sleeping producers (O(klogn)) */
+void applyOperations(CombiningWriter* writer, CombiningOperation* list)
+{
+    DataStructure* ds = writer->ds;
+    CombiningOperation* next;
+
+    writeBegin(ds);
+    for (; list != NULL; list = next)
+    {
+        next = list->next;      /* producer may reuse operation once done */
+        if (list->type == OPERATION_ADD) AddProduct(ds, list->time, list->quality);
+        else RemoveProduct(ds, list->time);
+        if (list->callback) list->callback(list, list->context);
+        __atomic_store_n(&list->done, 1, __ATOMIC_SEQ_CST);
+    }
+    writeEnd(ds);
+
+    if (__atomic_load_n(&writer->waiters, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&writer->lock);
+        pthread_cond_broadcast(&writer->finished);
+        pthread_mutex_unlock(&writer->lock);
+    }
+}
+
+/* combiner thread - takes all pending operations at once, applies them in time order and sleeps when idle */
+void* combinerTask(void* arg)
+{
+    CombiningWriter* writer = (CombiningWriter*)arg;
+    CombiningOperation *batch, *reversed, *next;
+    int count;
+
+    while (1)
+    {
+        batch = __atomic_exchange_n(&writer->pending, NULL, __ATOMIC_ACQUIRE);
+        if (batch == NULL)
+        {
+            if (__atomic_load_n(&writer->stopping, __ATOMIC_SEQ_CST)) break;
+
+            /* sleep until a producer submits - recheck after announcing sleep so no wake up is lost */
+            pthread_mutex_lock(&writer->lock);
+            __atomic_store_n(&writer->sleeping, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&writer->pending, __ATOMIC_SEQ_CST) == NULL && !__atomic_load_n(&writer->stopping, __ATOMIC_SEQ_CST))
+            {
+                pthread_cond_wait(&writer->wake, &writer->lock);
+            }
+            __atomic_store_n(&writer->sleeping, 0, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&writer->lock);
+            continue;
+        }
+        /* stack is newest first - reverse to submission order */
+        reversed = NULL;
+        for (count = 0; batch != NULL; batch = next, count++)
+        {
+            next = batch->next;
+            batch->next = reversed;
+            reversed = batch;
+        }
+        applyOperations(writer, sortOperations(reversed, count));
+    }
+    return NULL;
+}
+
+#endif
+
+#ifdef QUERY_SERVER
+
+/* returns 1 if operation only reads the data structure */
+int serverReadOnly(int operation)
+{
+    return (operation == SERVER_ITH || operation == SERVER_ITH_BETWEEN || operation == SERVER_EXISTS);
+}
+
+/* returns 1 if operation writes a single time, so it can be reordered with writes of other times */
+int serverTimeWrite(int operation)
+{
+    return (operation == SERVER_ADD || operation == SERVER_REMOVE);
+}
+
+/* orders pointers to requests of one batch by time, requests of the same time keep their order */
+int compareTimeWrites(const void* a, const void* b)
+{
+    const ServerRequest* x = *(const ServerRequest* const*)a;
+    const ServerRequest* y = *(const ServerRequest* const*)b;
+    if (x->time1 != y->time1) return (x->time1 < y->time1 ? -1 : 1);
+    return (x < y ? -1 : (x > y));
+}
+
+/* runs one request on ds and returns its response */
+ServerResponse serveRequest(DataStructure* ds, ServerRequest* request)
+{
+    ServerResponse response;
+    unsigned long version;
+    int writeDepth;
+
+    response.result = 0;
+    response.status = 1;
+
+    switch (request->operation)
+    {
+    case SERVER_INIT:
+        /* empty ds in place, the seqlock version and depth of serveBatch's write stay */
+        freeInstance(ds);
+        version = ds->version;
+        writeDepth = ds->writeDepth;
+        *ds = InitBuffered(request->quality, SERVER_BUFFER);
+        ds->version = version;
+        ds->writeDepth = writeDepth;
+        break;
+    case SERVER_ADD:
+        response.status = AddProduct(ds, request->time1, request->quality);
+        break;
+    case SERVER_REMOVE:
+        RemoveProduct(ds, request->time1);
+        break;
+    case SERVER_REMOVE_QUALITY:
+        RemoveQuality(ds, request->quality);
+        break;
+    case SERVER_ITH:
+        response.status = FindIthRankProduct(*ds, request->rank, &response.result);
+        break;
+    case SERVER_ITH_BETWEEN:
+        response.status = FindIthRankProductBetween(*ds, request->time1, request->time2, request->rank, &response.result);
+        break;
+    case SERVER_EXISTS:
+        response.result = Exists(*ds);
+        break;
+    default:
+        response.status = 0;
+    }
+    return response;
+}
+
+/* answers a batch of up to SERVER_BATCH pipelined requests as if run in order - each run of adds and removes is applied
+   in time order and the write buffer is drained once before the queries after it (O(klogk) for sorting k writes) */
+void serveBatch(DataStructure* ds, ServerRequest* requests, int count, ServerResponse* responses)
+{
+    ServerRequest* run[SERVER_BATCH];
+    int j, k, length;
+
+    for (j = 0; j < count; j = k)
+    {
+        /* queries, quality removes and inits one at a time */
+        if (!serverTimeWrite(requests[j].operation))
+        {
+            responses[j] = serveRequest(ds, &requests[j]);
+            k = j + 1;
+            continue;
+        }
+
+        /* writes of different times commute, so a run of them can be sorted by time (O(klogk)) */
+        for (k = j; k < count && serverTimeWrite(requests[k].operation); k++) run[k - j] = &requests[k];
+        length = k - j;
+        qsort(run, length, sizeof(ServerRequest*), compareTimeWrites);
+
+        writeBegin(ds);
+        for (j = 0; j < length; j++) responses[run[j] - requests] = serveRequest(ds, run[j]);
+        /* queries read the trees only, instead of merging every buffered product (O(capacity * logn)) */
+        if (k < count && serverReadOnly(requests[k].operation)) FlushBuffer(ds);
+        writeEnd(ds);
+    }
+}
+
+#endif
+
+#if defined(SELF_TEST)
+
+#define TEST_TIMES 256         /* random products have times 0 to 255 */
+#define TEST_QUALITIES 16      /* and qualities 0 to 15 */
+
+/* products a data structure should hold, its queries are checked against them */
+typedef struct TestModel {
+    TimeType times[TEST_TIMES];
+    QualityType qualities[TEST_TIMES];
+    int count;
+} TestModel;
+
+/* number of failed checks */
+int testFailures = 0;
+
+/* counts a failed check and prints its test, line and condition */
+#define CHECK(condition) testCheck((condition), #condition, __func__, __LINE__)
+
+void testCheck(int passed, const char* condition, const char* test, int line)
+{
+    if (passed) return;
+    printf("%s, line %d: %s failed\n", test, line, condition);
+    testFailures++;
+}
+
+/* returns index of product with time in model, -1 if not found */
+int modelFind(TestModel* model, TimeType time)
+{
+    int j;
+    for (j = 0; j < model->count; j++)
+    {
+        if (model->times[j] == time) return j;
+    }
+    return -1;
+}
+
+/* adds a product to ds and model, times already in model are skipped */
+void testAdd(DataStructure* ds, TestModel* model, TimeType time, QualityType quality)
+{
+    if (modelFind(model, time) >= 0) return;
+    CHECK(AddProduct(ds, time, quality) == 1);
+    model->times[model->count] = time;
+    model->qualities[model->count] = quality;
+    model->count++;
+}
+
+/* removes a product by time from ds and model */
+void testRemove(DataStructure* ds, TestModel* model, TimeType time)
+{
+    int j = modelFind(model, time);
+
+    RemoveProduct(ds, time);
+    if (j < 0) return;
+    model->count--;
+    model->times[j] = model->times[model->count];
+    model->qualities[j] = model->qualities[model->count];
+}
+
+/* removes all products with quality from ds and model */
+void testRemoveQuality(DataStructure* ds, TestModel* model, QualityType quality)
+{
+    int j;
+
+    RemoveQuality(ds, quality);
+    for (j = 0; j < model->count; )
+    {
+        if (model->qualities[j] != quality) j++;
+        else
+        {
+            model->count--;
+            model->times[j] = model->times[model->count];
+            model->qualities[j] = model->qualities[model->count];
+        }
+    }
+}
+
+/* checks rank queries, counts and Exists of ds against model, overall and in a few time ranges (O(n^2)) */
+void checkQueries(DataStructure ds, TestModel* model)
+{
+    int order[TEST_TIMES];
+    int exists, rank, j, k;
+    TimeType left;
+
+    /* model products by rank, insertion sort */
+    for (j = 0; j < model->count; j++)
+    {
+        for (k = j; k > 0 && compareProducts(model->times[j], model->qualities[j],
+                                             model->times[order[k - 1]], model->qualities[order[k - 1]]) < 0; k--)
+        {
+            order[k] = order[k - 1];
+        }
+        order[k] = j;
+    }
+
+    /* every rank, and one past the last */
+    CHECK(CountBetween(ds, 0, TEST_TIMES) == model->count);
+    for (j = 0; j < model->count; j++) CHECK(GetIthRankProduct(ds, j + 1) == model->times[order[j]]);
+    CHECK(GetIthRankProduct(ds, model->count + 1) == (TimeType)-1);
+    CHECK(GetIthRankProduct(ds, 0) == (TimeType)-1);
+
+    /* every rank of time ranges, bounds given in both orders */
+    for (left = 0; left < TEST_TIMES; left += 37)
+    {
+        rank = 0;
+        for (j = 0; j < model->count; j++)
+        {
+            if (model->times[order[j]] < left || model->times[order[j]] > left + 50) continue;
+            rank++;
+            CHECK(GetIthRankProductBetween(ds, left + 50, left, rank) == model->times[order[j]]);
+        }
+        CHECK(CountBetween(ds, left, left + 50) == rank);
+        CHECK(GetIthRankProductBetween(ds, left, left + 50, rank + 1) == (TimeType)-1);
+    }
+
+    exists = 0;
+    for (j = 0; j < model->count; j++)
+    {
+        if (model->qualities[j] == ds.special) exists = 1;
+    }
+    CHECK(Exists(ds) == exists);
+}
+
+/* runs random adds and removes on ds and model, checks queries every 16 operations */
+void randomOperations(DataStructure* ds, TestModel* model, int operations)
+{
+    int choice, j;
+
+    for (j = 1; j <= operations; j++)
+    {
+        choice = rand() % 20;
+        if (choice < 12) testAdd(ds, model, rand() % TEST_TIMES, rand() % TEST_QUALITIES);
+        else if (choice < 19) testRemove(ds, model, rand() % TEST_TIMES);
+        else testRemoveQuality(ds, model, rand() % TEST_QUALITIES);
+        if (j % 16 == 0) checkQueries(*ds, model);
+    }
+    checkQueries(*ds, model);
+}
+
+/* write buffer - adds wait in the buffer, once it is full every add moves BUFFER_DRAIN_STEP products to the trees */
+void testWriteBuffer(void)
+{
+    DataStructure ds = InitBuffered(3, 8);
+    TestModel model;
+    int j;
+
+    model.count = 0;
+    for (j = 0; j < 7; j++) testAdd(&ds, &model, 10 * j, j % 4);
+    CHECK(ds.bufferSize == 7 && ds.timeRoot == NULL);
+    checkQueries(ds, &model);
+
+    /* the add filling the buffer starts draining it */
+    testAdd(&ds, &model, 5, 2);
+    CHECK(ds.bufferSize == 8 - min(BUFFER_DRAIN_STEP, 8));
+    checkQueries(ds, &model);
+    testAdd(&ds, &model, 15, 0);
+    CHECK(ds.bufferSize <= max(8 - 2 * BUFFER_DRAIN_STEP + 1, 1));
+    checkQueries(ds, &model);
+
+    /* queries see products in buffer and trees, removes find them in both */
+    randomOperations(&ds, &model, 2000);
+    CHECK(ds.bufferSize <= ds.bufferCapacity);
+    FlushBuffer(&ds);
+    CHECK(ds.bufferSize == 0);
+    checkQueries(ds, &model);
+    freeInstance(&ds);
+}
+
+/* checks x's height (AVL) or rank (WAVL) against its children's by the balancing policy */
+void checkBalance(Product* x)
+{
+    int leftHeight = nodeRank(x->left), rightHeight = nodeRank(x->right);
+
+    if (balancePolicy == WAVL_POLICY)
+    {
+        /* rank differences 1 or 2, leaves have rank 0 */
+        CHECK(x->height - leftHeight >= 1 && x->height - leftHeight <= 2);
+        CHECK(x->height - rightHeight >= 1 && x->height - rightHeight <= 2);
+        CHECK(x->left != NULL || x->right != NULL || x->height == 0);
+    }
+    else CHECK(x->height == max(leftHeight, rightHeight) + 1 && abs(leftHeight - rightHeight) <= 1);
+}
+
+/* checks parents, subtree sizes and balance of a time tree or time subtree */
+void checkTimeTree(Product* x, Product* parent)
+{
+    if (x == NULL) return;
+    CHECK(x->parent == parent);
+    CHECK(x->subtreeSize == productWeight(x) + (x->left ? x->left->subtreeSize : 0) + (x->right ? x->right->subtreeSize : 0));
+    checkBalance(x);
+    checkTimeTree(x->left, x);
+    checkTimeTree(x->right, x);
+}
+
+/* checks parents, subtree sizes and balance of a quality tree and its time subtrees */
+void checkQualityTree(Product* x, Product* parent)
+{
+    if (x == NULL) return;
+    CHECK(x->parent == parent);
+    CHECK(x->subtreeSize == timeSubtreeSize(x) + (x->left ? x->left->subtreeSize : 0) + (x->right ? x->right->subtreeSize : 0));
+    checkBalance(x);
+    checkTimeTree(x->timeSubtree, NULL);
+    checkQualityTree(x->left, x);
+    checkQualityTree(x->right, x);
+}
+
+/* balancing policy - adds and removes keep the trees balanced by the build's policy, WAVL removes rotate at most twice per tree */
+void testBalancing(void)
+{
+    DataStructure ds = Init(3);
+    TestModel model;
+    long rotations;
+    int j;
+
+    /* adds in time order */
+    model.count = 0;
+    for (j = 0; j < TEST_TIMES; j++) testAdd(&ds, &model, j, j % 3);
+    CHECK(rotationCount > 0);
+    checkTimeTree(ds.timeRoot, NULL);
+    checkQualityTree(ds.qualityRoot, NULL);
+    checkQueries(ds, &model);
+
+    /* removes in time order - a remove changes the time tree, a time subtree and maybe the quality tree */
+    for (j = 0; j < TEST_TIMES; j += 2)
+    {
+        rotations = rotationCount;
+        testRemove(&ds, &model, j);
+        if (balancePolicy == WAVL_POLICY) CHECK(rotationCount - rotations <= 6);
+    }
+    checkTimeTree(ds.timeRoot, NULL);
+    checkQualityTree(ds.qualityRoot, NULL);
+    checkQueries(ds, &model);
+
+    for (j = 0; j < 40; j++)
+    {
+        randomOperations(&ds, &model, 100);
+        checkTimeTree(ds.timeRoot, NULL);
+        checkQualityTree(ds.qualityRoot, NULL);
+    }
+    freeInstance(&ds);
+}
+
+/* key types - FindIthRankProduct finds a product at time -1, times beyond 32 bits keep their order when TimeType is wide enough */
+void testKeyTypes(void)
+{
+    DataStructure ds = Init(3);
+    TimeType time, wide;
+    int j;
+
+    CHECK(FindIthRankProduct(ds, 1, &time) == 0);
+    AddProduct(&ds, (TimeType)-1, 2);
+    CHECK(FindIthRankProduct(ds, 1, &time) == 1 && time == (TimeType)-1);
+    CHECK(FindIthRankProduct(ds, 2, &time) == 0);
+    CHECK(FindIthRankProductBetween(ds, (TimeType)-1, (TimeType)-1, 1, &time) == 1 && time == (TimeType)-1);
+    freeInstance(&ds);
+
+    if (sizeof(TimeType) < 8) return;
+    wide = 1;
+    for (j = 0; j < 40; j++) wide *= 2;
+    AddProduct(&ds, wide + 1, 1);
+    AddProduct(&ds, wide, 1);
+    AddProduct(&ds, 5, 1);
+    CHECK(GetIthRankProduct(ds, 1) == 5 && GetIthRankProduct(ds, 2) == wide && GetIthRankProduct(ds, 3) == wide + 1);
+    CHECK(CountBetween(ds, wide, wide + 1) == 2);
+    CHECK(GetIthRankProductBetween(ds, wide, wide + 1, 2) == wide + 1);
+    freeInstance(&ds);
+}
+
+#ifdef PRODUCT_PAYLOAD_TYPE
+
+/* fills payload with bytes made from j */
+void testPayload(PayloadType* payload, int j)
+{
+    memset(payload, j % 200 + 1, sizeof(PayloadType));
+}
+
+/* payloads - stored with products in write buffer or trees, found by time until the product is removed */
+void testPayloads(int capacity)
+{
+    DataStructure ds = InitBuffered(3, capacity);
+    PayloadType payload, expected;
+    int j;
+
+    for (j = 0; j < TEST_TIMES; j++)
+    {
+        testPayload(&payload, j);
+        CHECK(AddProductWithPayload(&ds, j * 7 % TEST_TIMES, j % 5, payload) == 1);
+    }
+    for (j = 0; j < TEST_TIMES; j += 3) RemoveProduct(&ds, j * 7 % TEST_TIMES);
+
+    for (j = 0; j < TEST_TIMES; j++)
+    {
+        testPayload(&expected, j);
+        if (j % 3 == 0) CHECK(GetProductPayload(ds, j * 7 % TEST_TIMES, &payload) == 0);
+        else CHECK(GetProductPayload(ds, j * 7 % TEST_TIMES, &payload) == 1 && memcmp(&payload, &expected, sizeof(PayloadType)) == 0);
+    }
+
+    /* payloads move with flushed products */
+    FlushBuffer(&ds);
+    for (j = 1; j < TEST_TIMES; j += 3)
+    {
+        testPayload(&expected, j);
+        CHECK(GetProductPayload(ds, j * 7 % TEST_TIMES, &payload) == 1 && memcmp(&payload, &expected, sizeof(PayloadType)) == 0);
+    }
+    freeInstance(&ds);
+}
+
+#endif
+
+/* merge - src's products move to dst, dst keeps its product on equal times, data structures with different allocators are not merged */
+void testMerge(void)
+{
+    DataStructure dst = InitBuffered(3, 8), src = Init(3);
+    TestModel model, srcModel;
+    MemoryPool pool;
+    int j;
+
+    model.count = 0;
+    srcModel.count = 0;
+    randomOperations(&dst, &model, 300);
+    randomOperations(&src, &srcModel, 300);
+    for (j = 0; j < srcModel.count; j++)
+    {
+        if (modelFind(&model, srcModel.times[j]) >= 0) continue;
+        model.times[model.count] = srcModel.times[j];
+        model.qualities[model.count] = srcModel.qualities[j];
+        model.count++;
+    }
+    CHECK(Merge(&dst, &src) == 1);
+    CHECK(src.timeRoot == NULL && src.qualityRoot == NULL && Exists(src) == 0);
+    checkQueries(dst, &model);
+    checkTimeTree(dst.timeRoot, NULL);
+    checkQualityTree(dst.qualityRoot, NULL);
+
+    /* merging into itself moves nothing */
+    CHECK(Merge(&dst, &dst) == 0);
+    checkQueries(dst, &model);
+    checkTimeTree(dst.timeRoot, NULL);
+    checkQualityTree(dst.qualityRoot, NULL);
+
+    /* both stay usable */
+    srcModel.count = 0;
+    randomOperations(&dst, &model, 300);
+    randomOperations(&src, &srcModel, 300);
+    freeInstance(&src);
+
+    /* different allocators */
+    pool = initPool(sizeof(Product), 64);
+    src.pool = &pool;
+    srcModel.count = 0;
+    randomOperations(&src, &srcModel, 100);
+    CHECK(Merge(&dst, &src) == 0);
+    checkQueries(dst, &model);
+    checkQueries(src, &srcModel);
+    freeInstance(&src);
+    freePool(&pool);
+    freeInstance(&dst);
+}
+
+/* merge of big trees - runs parallel unions in -DPARALLEL_MERGE builds, src's products on dst's times are dropped */
+void testBigMerge(void)
+{
+    DataStructure dst = Init(3), src = Init(3);
+    int n = 4 * MERGE_GRAIN, j;
+
+    /* dst has even times, src has all times with quality 0 on even ones, every rank is its time + 1 if src's are dropped */
+    for (j = 0; j < 2 * n; j += 2) AddProduct(&dst, j, j / 4);
+    for (j = 0; j < 2 * n; j++) AddProduct(&src, j, (j % 2 ? j / 4 : 0));
+    CHECK(Merge(&dst, &src) == 1);
+
+    CHECK(CountBetween(dst, 0, 2 * n) == 2 * n && src.timeRoot == NULL);
+    for (j = 0; j < 2 * n; j++) CHECK(GetIthRankProduct(dst, j + 1) == j);
+    checkTimeTree(dst.timeRoot, NULL);
+    checkQualityTree(dst.qualityRoot, NULL);
+    freeInstance(&dst);
+}
+
+#ifdef BUCKET_TIME_INDEX
+
+/* checks bucket sizes, time order, subtree sizes, minimums and balance of a bucket index, previous is the last time seen */
+void checkBuckets(BucketNode* x, TimeType* previous, int* seen)
+{
+    Bucket* b;
+    int j;
+
+    if (x == NULL) return;
+    b = x->bucket;
+
+    /* leaf - sorted times after all times of the leaves before it */
+    if (b != NULL)
+    {
+        CHECK(b->count > 0 && b->count <= BUCKET_SIZE && x->subtreeSize == b->count && x->height == 0);
+        for (j = 0; j < b->count; j++)
+        {
+            CHECK(!*seen || b->times[j] > *previous);
+            CHECK(compareProducts(x->minTime, x->minQuality, b->times[j], b->qualities[j]) <= 0);
+            *previous = b->times[j];
+            *seen = 1;
+        }
+        return;
+    }
+
+    CHECK(x->left != NULL && x->right != NULL);
+    if (x->left == NULL || x->right == NULL) return;
+    checkBuckets(x->left, previous, seen);
+    CHECK(*previous < x->splitTime);
+    checkBuckets(x->right, previous, seen);
+    CHECK(x->subtreeSize == x->left->subtreeSize + x->right->subtreeSize);
+    CHECK(x->height == max(x->left->height, x->right->height) + 1 && abs(x->left->height - x->right->height) <= 1);
+    CHECK(compareProducts(x->minTime, x->minQuality, x->left->minTime, x->left->minQuality) <= 0);
+    CHECK(compareProducts(x->minTime, x->minQuality, x->right->minTime, x->right->minQuality) <= 0);
+}
+
+/* bucket time index - holds the time tree's products in full and sparse buckets, range queries use it */
+void testBucketIndex(void)
+{
+    DataStructure ds = Init(3);
+    TestModel model;
+    TimeType previous = 0;
+    int seen = 0, j;
+
+    /* full buckets from adds in time order, split ones from adds in random order */
+    model.count = 0;
+    for (j = 0; j < TEST_TIMES; j += 2) testAdd(&ds, &model, j, rand() % TEST_QUALITIES);
+    for (j = 0; j < TEST_TIMES; j++) testAdd(&ds, &model, rand() % TEST_TIMES, rand() % TEST_QUALITIES);
+    checkBuckets(ds.bucketRoot, &previous, &seen);
+    CHECK(ds.bucketRoot != NULL && ds.bucketRoot->subtreeSize == model.count);
+    checkQueries(ds, &model);
+
+    /* sparse and emptied buckets */
+    for (j = 0; j < TEST_TIMES; j++)
+    {
+        if (j % 5 != 0) testRemove(&ds, &model, j);
+    }
+    previous = 0;
+    seen = 0;
+    checkBuckets(ds.bucketRoot, &previous, &seen);
+    CHECK(ds.bucketRoot != NULL && ds.bucketRoot->subtreeSize == model.count);
+    checkQueries(ds, &model);
+
+    randomOperations(&ds, &model, 1000);
+    previous = 0;
+    seen = 0;
+    checkBuckets(ds.bucketRoot, &previous, &seen);
+    freeInstance(&ds);
+}
+
+#endif
+
+/* small instance - products stay in arrays below the threshold, the add reaching it moves all of them to the trees */
+void testSmallInstance(void)
+{
+    DataStructure ds = InitSmall(3, 16);
+    TestModel model;
+    int j;
+
+    model.count = 0;
+    for (j = 0; j < 15; j++) testAdd(&ds, &model, 3 * j, j % 4);
+    testRemove(&ds, &model, 6);
+    testAdd(&ds, &model, 7, 3);
+    CHECK(ds.smallInstance == 1 && ds.timeRoot == NULL && ds.bufferSize == 15);
+    checkQueries(ds, &model);
+
+    testAdd(&ds, &model, 100, 2);
+    CHECK(ds.smallInstance == 0 && ds.bufferCapacity == 0 && ds.timeRoot != NULL && ds.timeRoot->subtreeSize == 16);
+    checkQueries(ds, &model);
+    randomOperations(&ds, &model, 500);
+    freeInstance(&ds);
+}
+
+/* tenant manager - every tenant keeps its own products, a removed tenant is gone and the others are not changed */
+void testTenants(void)
+{
+    TenantManager manager = InitManager(8);
+    DataStructure* ds;
+    TestModel model;
+    long tenant, id;
+    int j;
+
+    /* tenants with 0 to 19 products, some stay small */
+    for (tenant = 0; tenant < 100; tenant++)
+    {
+        id = tenant * 7919 - 400000;
+        ds = AddTenant(&manager, id, tenant % 7);
+        CHECK(ds != NULL && GetTenant(&manager, id) == ds && AddTenant(&manager, id, 0) == ds);
+        if (ds == NULL) continue;
+        for (j = 0; j < tenant % 20; j++) CHECK(AddProduct(ds, j, (tenant + j) % 5) == 1);
+    }
+    CHECK(manager.count == 100);
+
+    for (tenant = 0; tenant < 100; tenant += 3)
+    {
+        RemoveTenant(&manager, tenant * 7919 - 400000);
+        CHECK(GetTenant(&manager, tenant * 7919 - 400000) == NULL);
+    }
+    CHECK(manager.count == 66);
+
+    for (tenant = 0; tenant < 100; tenant++)
+    {
+        if (tenant % 3 == 0) continue;
+        ds = GetTenant(&manager, tenant * 7919 - 400000);
+        CHECK(ds != NULL);
+        if (ds == NULL) continue;
+        CHECK(ds->smallInstance == (tenant % 20 < 8));
+        model.count = 0;
+        for (j = 0; j < tenant % 20; j++)
+        {
+            model.times[j] = j;
+            model.qualities[j] = (tenant + j) % 5;
+            model.count++;
+        }
+        checkQueries(*ds, &model);
+    }
+
+    FreeManager(&manager);
+    CHECK(manager.count == 0 && GetTenant(&manager, 7919 - 400000) == NULL);
+}
+
+#ifdef COMBINING_WRITER
+
+#define TEST_PRODUCERS 4       /* producer threads of the combining writer check */
+
+/* producer thread of the combining writer check, owns times equal to first modulo TEST_PRODUCERS */
+typedef struct TestProducer {
+    CombiningWriter* writer;
+    int first;
+    int callbacks;             /* asynchronous operations done, counted by their callback */
+} TestProducer;
+
+/* counts a done asynchronous operation */
+void testCallback(CombiningOperation* operation, void* context)
+{
+    (void)operation;
+    __atomic_add_fetch(&((TestProducer*)context)->callbacks, 1, __ATOMIC_RELAXED);
+}
+
+/* holds the combiner until the producer of context's writer sleeps in WaitOperation */
+void testSlowCallback(CombiningOperation* operation, void* context)
+{
+    CombiningWriter* writer = (CombiningWriter*)context;
+    struct timespec pause = { 0, 1000000 };
+    int j;
+
+    (void)operation;
+    for (j = 0; j < 5000 && __atomic_load_n(&writer->waiters, __ATOMIC_SEQ_CST) == 0; j++) nanosleep(&pause, NULL);
+    CHECK(__atomic_load_n(&writer->waiters, __ATOMIC_SEQ_CST) == 1);
+}
+
+/* adds own times, removes half of them, then submits removes and a remove & add pair per time without waiting in between */
+void* testProducerTask(void* arg)
+{
+    TestProducer* producer = (TestProducer*)arg;
+    CombiningOperation operations[2 * TEST_TIMES / TEST_PRODUCERS];
+    int count = 0, time, j;
+
+    for (time = producer->first; time < TEST_TIMES; time += TEST_PRODUCERS) CombinedAddProduct(producer->writer, time, time % TEST_QUALITIES);
+    for (time = producer->first; time < TEST_TIMES; time += TEST_PRODUCERS)
+    {
+        if (time / 4 % 2 == 0) CombinedRemoveProduct(producer->writer, time);
+    }
+
+    /* times with time / 4 % 4 == 1 are removed, those with 3 get quality time + 1 */
+    for (time = producer->first; time < TEST_TIMES; time += TEST_PRODUCERS)
+    {
+        if (time / 4 % 2 == 0) continue;
+        operations[count].type = OPERATION_REMOVE;
+        operations[count].time = time;
+        count++;
+        if (time / 4 % 4 == 1) continue;
+        operations[count].type = OPERATION_ADD;
+        operations[count].time = time;
+        operations[count].quality = (time + 1) % TEST_QUALITIES;
+        count++;
+    }
+    for (j = 0; j < count; j++)
+    {
+        operations[j].callback = testCallback;
+        operations[j].context = producer;
+        SubmitOperation(producer->writer, &operations[j]);
+    }
+    for (j = 0; j < count; j++) WaitOperation(&operations[j]);
+    CHECK(__atomic_load_n(&producer->callbacks, __ATOMIC_RELAXED) == count);
+    return NULL;
+}
+
+/* combining writer - operations of many producer threads are all applied, in submission order for the same time */
+void testCombiningWriter(void)
+{
+    DataStructure ds = InitBuffered(3, 8);
+    CombiningWriter* writer = StartCombiner(&ds);
+    TestProducer producers[TEST_PRODUCERS];
+    pthread_t threads[TEST_PRODUCERS];
+    CombiningOperation slow, waited;
+    TestModel model;
+    int j;
+
+    CHECK(writer != NULL);
+    if (writer == NULL) return;
+    for (j = 0; j < TEST_PRODUCERS; j++)
+    {
+        producers[j].writer = writer;
+        producers[j].first = j;
+        producers[j].callbacks = 0;
+        pthread_create(&threads[j], NULL, testProducerTask, &producers[j]);
+    }
+    for (j = 0; j < TEST_PRODUCERS; j++) pthread_join(threads[j], NULL);
+    StopCombiner(writer);
+
+    model.count = 0;
+    for (j = 0; j < TEST_TIMES; j++)
+    {
+        if (j / 4 % 4 != 3) continue;
+        model.times[model.count] = j;
+        model.qualities[model.count] = (j + 1) % TEST_QUALITIES;
+        model.count++;
+    }
+    checkQueries(ds, &model);
+
+    /* a producer waiting on a slow batch sleeps until the combiner wakes it */
+    writer = StartCombiner(&ds);
+    CHECK(writer != NULL);
+    if (writer != NULL)
+    {
+        slow.type = OPERATION_ADD;
+        slow.time = TEST_TIMES;
+        slow.quality = 0;
+        slow.callback = testSlowCallback;
+        slow.context = writer;
+        waited.type = OPERATION_REMOVE;
+        waited.time = TEST_TIMES;
+        waited.callback = NULL;
+        SubmitOperation(writer, &slow);
+        SubmitOperation(writer, &waited);
+        WaitOperation(&waited);
+        CHECK(OperationDone(&slow) && writer->waiters == 0);
+        StopCombiner(writer);
+    }
+    checkQueries(ds, &model);
+    freeInstance(&ds);
+}
+
+#endif
+
+/* checks CountInBox and QualityQuantileBetween of ds against model for a grid of time and quality ranges */
+void checkBoxQueries(DataStructure ds, TestModel* model)
+{
+    double quantiles[] = { 0, 0.1, 0.5, 0.75, 1 };
+    QualityType qualities[TEST_TIMES], low, found;
+    TimeType left;
+    int count, rank, j, k;
+
+    for (left = 0; left < TEST_TIMES; left += 29)
+    {
+        /* qualities in time range, sorted */
+        count = 0;
+        for (j = 0; j < model->count; j++)
+        {
+            if (model->times[j] < left || model->times[j] > left + 60) continue;
+            for (k = count++; k > 0 && qualities[k - 1] > model->qualities[j]; k--) qualities[k] = qualities[k - 1];
+            qualities[k] = model->qualities[j];
+        }
+
+        /* boxes, bounds given in both orders */
+        for (low = 0; low < TEST_QUALITIES; low += 3)
+        {
+            rank = 0;
+            for (j = 0; j < count; j++) rank += (qualities[j] >= low && qualities[j] <= low + 4);
+            CHECK(CountInBox(ds, left + 60, left, low + 4, low) == rank);
+        }
+
+        /* quantiles, rank q * count rounded up */
+        for (j = 0; j < 5; j++)
+        {
+            found = -1;
+            CHECK(QualityQuantileBetween(ds, left, left + 60, quantiles[j], &found) == (count > 0));
+            if (count == 0) continue;
+            rank = (int)(quantiles[j] * count);
+            if (rank < quantiles[j] * count) rank++;
+            CHECK(found == qualities[max(rank, 1) - 1]);
+        }
+    }
+    CHECK(QualityQuantileBetween(ds, 0, TEST_TIMES, 1.5, &found) == 0);
+}
+
+/* box counting - counts and quantiles of time and quality ranges, from the quality tree or the dominance index */
+void testBoxCounting(void)
+{
+    DataStructure ds = InitBuffered(3, 8);
+    TestModel model;
+    int j;
+
+    model.count = 0;
+    for (j = 0; j < 20; j++)
+    {
+        randomOperations(&ds, &model, 100);
+        checkBoxQueries(ds, &model);
+    }
+
+    /* empty time ranges */
+    for (j = 0; j < TEST_TIMES; j++)
+    {
+        if (j % 64 < 32) testRemove(&ds, &model, j);
+    }
+    checkBoxQueries(ds, &model);
+    CHECK(CountInBox(ds, 0, 31, 0, TEST_QUALITIES) == 0);
+    freeInstance(&ds);
+}
+
+#ifdef ONLINE_COMPACTION
+
+/* checks that moved products of a time tree lie in their live block, returns number of products not moved */
+int checkBlocks(Product* x)
+{
+    if (x == NULL) return 0;
+    CHECK(x->block == NULL || (x >= x->block->products && x < x->block->products + x->block->used && x->block->live > 0));
+    return (x->block == NULL) + checkBlocks(x->left) + checkBlocks(x->right);
+}
+
+/* checks moved quality nodes and time subtree products of a quality tree, returns number of them not moved */
+int checkQualityBlocks(Product* x)
+{
+    if (x == NULL) return 0;
+    CHECK(x->block == NULL || (x >= x->block->products && x < x->block->products + x->block->used && x->block->live > 0));
+    return (x->block == NULL) + checkBlocks(x->timeSubtree) + checkQualityBlocks(x->left) + checkQualityBlocks(x->right);
+}
+
+/* online compaction - small steps between writes keep every pointer valid, a whole pass moves all products to blocks */
+void testCompaction(void)
+{
+    DataStructure ds = Init(3);
+    CompactionReport report = { 0, 0, 0 };
+    TestModel model;
+    int passes = 0, j;
+
+    model.count = 0;
+    randomOperations(&ds, &model, 1000);
+
+    /* steps of 1 to 8 products between writes */
+    for (j = 0; j < 500; j++)
+    {
+        passes += CompactStep(&ds, 1 + rand() % 8, &report);
+        randomOperations(&ds, &model, 1);
+        checkBlocks(ds.timeRoot);
+        checkQualityBlocks(ds.qualityRoot);
+    }
+    CHECK(passes > 0 && report.moved > 0 && report.blockBytes > 0);
+    checkTimeTree(ds.timeRoot, NULL);
+    checkQualityTree(ds.qualityRoot, NULL);
+
+    /* finish the current pass, then a whole pass in one step */
+    while (!CompactStep(&ds, 4 * TEST_TIMES, &report));
+    CHECK(CompactStep(&ds, 4 * TEST_TIMES, &report) == 1);
+    CHECK(checkBlocks(ds.timeRoot) == 0 && checkQualityBlocks(ds.qualityRoot) == 0 && ds.compactBlock == NULL);
+    checkQueries(ds, &model);
+    randomOperations(&ds, &model, 500);
+    freeInstance(&ds);
+}
+
+#endif
+
+#ifdef QUERY_SERVER
+
+/* returns a query server request */
+ServerRequest testRequest(int operation, TimeType time1, TimeType time2, QualityType quality, int rank)
+{
+    ServerRequest request;
+    memset(&request, 0, sizeof(request));
+    request.operation = operation;
+    request.time1 = time1;
+    request.time2 = time2;
+    request.quality = quality;
+    request.rank = rank;
+    return request;
+}
+
+/* query server - a pipelined batch is answered as if run in request order, SERVER_INIT empties the data structure inside the batch */
+void testQueryServer(void)
+{
+    DataStructure ds = InitBuffered(0, SERVER_BUFFER);
+    ServerRequest requests[14];
+    ServerResponse responses[14];
+    int j;
+
+    requests[0] = testRequest(SERVER_ADD, 5, 0, 2, 0);
+    requests[1] = testRequest(SERVER_ADD, 3, 0, 7, 0);
+    requests[2] = testRequest(SERVER_ITH, 0, 0, 0, 1);
+    requests[3] = testRequest(SERVER_INIT, 0, 0, 7, 0);
+    requests[4] = testRequest(SERVER_EXISTS, 0, 0, 0, 0);
+    requests[5] = testRequest(SERVER_ADD, 4, 0, 7, 0);
+    requests[6] = testRequest(SERVER_ADD, 9, 0, 1, 0);
+    requests[7] = testRequest(SERVER_ADD, 6, 0, 1, 0);
+    requests[8] = testRequest(SERVER_ITH_BETWEEN, 0, 5, 0, 1);
+    requests[9] = testRequest(SERVER_EXISTS, 0, 0, 0, 0);
+    requests[10] = testRequest(SERVER_REMOVE_QUALITY, 0, 0, 1, 0);
+    requests[11] = testRequest(SERVER_REMOVE, 4, 0, 0, 0);
+    requests[12] = testRequest(SERVER_ITH, 0, 0, 0, 1);
+    requests[13] = testRequest(99, 0, 0, 0, 0);
+    serveBatch(&ds, requests, 14, responses);
+
+    CHECK(responses[0].status == 1 && responses[1].status == 1);
+    CHECK(responses[2].status == 1 && responses[2].result == 5);
+    CHECK(responses[3].status == 1);
+    CHECK(responses[4].status == 1 && responses[4].result == 0);
+    CHECK(responses[8].status == 1 && responses[8].result == 4);
+    CHECK(responses[9].status == 1 && responses[9].result == 1);
+    CHECK(responses[12].status == 0);
+    CHECK(responses[13].status == 0);
+    CHECK(ds.writeDepth == 0);
+    for (j = 0; j < 14; j++) CHECK(serverReadOnly(requests[j].operation) == (j == 2 || j == 4 || j == 8 || j == 9 || j == 12));
+
+    /* a run of writes is sorted by time, writes of one time keep their order, the buffer is drained before a query */
+    requests[0] = testRequest(SERVER_ADD, 20, 0, 3, 0);
+    requests[1] = testRequest(SERVER_ADD, 10, 0, 3, 0);
+    requests[2] = testRequest(SERVER_REMOVE, 20, 0, 0, 0);
+    requests[3] = testRequest(SERVER_ADD, 20, 0, 1, 0);
+    requests[4] = testRequest(SERVER_ADD, 15, 0, 2, 0);
+    requests[5] = testRequest(SERVER_ITH, 0, 0, 0, 1);
+    requests[6] = testRequest(SERVER_ITH_BETWEEN, 10, 15, 0, 1);
+    requests[7] = testRequest(SERVER_ADD, 12, 0, 0, 0);
+    serveBatch(&ds, requests, 8, responses);
+    for (j = 0; j < 5; j++) CHECK(responses[j].status == 1);
+    CHECK(responses[5].status == 1 && responses[5].result == 20);
+    CHECK(responses[6].status == 1 && responses[6].result == 15);
+    CHECK(responses[7].status == 1 && ds.bufferSize == 1 && CountBetween(ds, 0, 30) == 4);
+    freeInstance(&ds);
+}
+
+#endif
+
+#ifdef QUALITY_SKETCH
+
+/* checks that the bin of ApproxQualityQuantile's quality holds ranks within err of the q-quantile's rank */
+void checkSketchQuantile(DataStructure ds, TestModel* model, TimeType left, TimeType right, double q, int exact)
+{
+    int count = 0, below = 0, inBin = 0, rank, err, j;
+    QualityType quality = ApproxQualityQuantile(ds, left, right, q, &err);
+
+    for (j = 0; j < model->count; j++)
+    {
+        if (model->times[j] < left || model->times[j] > right) continue;
+        count++;
+        if (qualityBin(model->qualities[j]) < qualityBin(quality)) below++;
+        else if (qualityBin(model->qualities[j]) == qualityBin(quality)) inBin++;
+    }
+    if (count == 0)
+    {
+        CHECK(err == -1);
+        return;
+    }
+    rank = (int)(q * count);
+    if (rank < q * count) rank++;
+    rank = max(rank, 1);
+    CHECK(err >= 0 && below + 1 <= rank + err && below + inBin >= rank - err);
+    if (exact) CHECK(err == 0);
+}
+
+/* checks quantiles of whole time buckets, which are exact up to a bin, and of ranges cutting buckets */
+void checkSketches(DataStructure ds, TestModel* model)
+{
+    double quantiles[] = { 0, 0.25, 0.5, 0.9, 1 };
+    TimeType left;
+    int j;
+
+    for (j = 0; j < 5; j++)
+    {
+        for (left = 0; left < 20 * SKETCH_WIDTH; left += 3 * SKETCH_WIDTH)
+        {
+            checkSketchQuantile(ds, model, left, left + 2 * SKETCH_WIDTH - 1, quantiles[j], 1);
+            checkSketchQuantile(ds, model, left + SKETCH_WIDTH / 3, left + 2 * SKETCH_WIDTH + SKETCH_WIDTH / 2, quantiles[j], 0);
+        }
+    }
+}
+
+/* quality sketches - approximate quantiles stay within their error through adds, removes and merges */
+void testQualitySketch(void)
+{
+    DataStructure ds = InitBuffered(3, 8), src = Init(3);
+    TestModel model;
+    int sketchCount, err, j;
+
+    /* times over 20 buckets, qualities up to 100000 fall in inexact bins */
+    model.count = 0;
+    for (j = 0; j < 200; j++) testAdd(&ds, &model, j * (SKETCH_WIDTH / 10), j * 7919 % 100000);
+    checkSketches(ds, &model);
+
+    for (j = 0; j < 200; j += 3) testRemove(&ds, &model, j * (SKETCH_WIDTH / 10));
+    testRemoveQuality(&ds, &model, 7919);
+    checkSketches(ds, &model);
+
+    /* src's products fill more of the buckets */
+    for (j = 0; j < 40; j++) AddProduct(&src, j * (SKETCH_WIDTH / 2) + 1, j % 100);
+    for (j = 0; j < 40; j++)
+    {
+        if (modelFind(&model, j * (SKETCH_WIDTH / 2) + 1) >= 0) continue;
+        model.times[model.count] = j * (SKETCH_WIDTH / 2) + 1;
+        model.qualities[model.count] = j % 100;
+        model.count++;
+    }
+    CHECK(Merge(&ds, &src) == 1);
+    checkSketches(ds, &model);
+
+    /* sketches that lost products to failed allocations - no sketch, or fewer products than the trees */
+    sketchCount = ds.sketchCount;
+    ds.sketchCount = 0;
+    CHECK(ApproxQualityQuantile(ds, 0, TEST_TIMES * SKETCH_WIDTH, 0.5, &err) == 0 && err == -1);
+    ds.sketchCount = sketchCount;
+    ds.sketches[sketchCount - 1].counts[ds.sketches[sketchCount - 1].size - 1]--;
+    CHECK(ApproxQualityQuantile(ds, 0, TEST_TIMES * SKETCH_WIDTH, 1, &err) == 0 && err == -1);
+    ds.sketches[sketchCount - 1].counts[ds.sketches[sketchCount - 1].size - 1]++;
+    checkSketches(ds, &model);
+    freeInstance(&ds);
+}
+
+#endif
+
+#ifdef LAZY_DELETE
+
+/* lazy delete - removes leave tombstones without rotations, the trees are rebuilt before tombstones pass TOMBSTONE_PERCENT */
+void testLazyDelete(void)
+{
+    DataStructure ds = Init(3);
+    TestModel model;
+    long rotations;
+    int removed = 0, j;
+
+    /* adds in time order rotate, so the counter is live in this build */
+    model.count = 0;
+    rotations = rotationCount;
+    for (j = 0; j < TEST_TIMES; j++) testAdd(&ds, &model, j, j % TEST_QUALITIES);
+    CHECK(rotationCount > rotations);
+    rotations = rotationCount;
+    testRemove(&ds, &model, 10);
+    CHECK(ds.tombstones == 1 && rotationCount == rotations);
+    checkQueries(ds, &model);
+
+    /* an add at a tombstone's time replaces it */
+    testAdd(&ds, &model, 10, 5);
+    CHECK(ds.tombstones == 0);
+    checkQueries(ds, &model);
+
+    /* removes 7 of every 8 products */
+    for (j = 0; j < TEST_TIMES; j++)
+    {
+        if (j % 8 == 0) continue;
+        testRemove(&ds, &model, j);
+        removed++;
+        CHECK((long)ds.tombstones * 100 <= (long)TOMBSTONE_PERCENT * (ds.timeRoot->subtreeSize + ds.tombstones));
     }
-    /* increment subtree size */
-    root->subtreeSize++;
+    CHECK(ds.tombstones < removed);
+    checkTimeTree(ds.timeRoot, NULL);
+    checkQualityTree(ds.qualityRoot, NULL);
+    checkQueries(ds, &model);
+
+    /* quality removes leave tombstones too, PurgeTombstones drops them all */
+    testRemoveQuality(&ds, &model, 8);
+    checkQueries(ds, &model);
+    CHECK(PurgeTombstones(&ds) == 1 && ds.tombstones == 0);
+    checkTimeTree(ds.timeRoot, NULL);
+    checkQualityTree(ds.qualityRoot, NULL);
+    checkQueries(ds, &model);
+
+    randomOperations(&ds, &model, 1000);
+    freeInstance(&ds);
+}
 
-    /* update minimum quality in subtree */
-    updateMinQuality(root);
+#endif
 
-    /* balance the tree */
-    root = balance(root);
+#ifdef SHARED_MEMORY
 
-    return root;
+/* reader program of testSharedMemory - attaches to segment name while the writer removes and adds back its count products,
+   every snapshot holds count or count - 1 of them */
+int shmReaderProgram(const char* name, int count)
+{
+    DataStructure* reader = ShmAttach(name);
+    unsigned long version;
+    TimeType time;
+    int total, last, beyond, between, snapshots;
+
+    CHECK(reader != NULL);
+    if (reader == NULL) return 1;
+    for (snapshots = 0; snapshots < 2000; snapshots++)
+    {
+        do
+        {
+            version = ReadBegin(reader);
+            total = CountBetween(*reader, 0, TEST_TIMES);
+            last = FindIthRankProduct(*reader, total, &time);
+            beyond = FindIthRankProduct(*reader, total + 1, &time);
+            between = FindIthRankProductBetween(*reader, 0, TEST_TIMES, total, &time);
+        } while (ReadRetry(reader, version));
+        CHECK((total == count || total == count - 1) && last && !beyond && between);
+    }
+    ShmDetach(reader);
+    return testFailures > 0;
 }
 
-/* insert a product to quality tree and return new root (O(logn)) */
-Product* insertQuality(Product* root, Product* x)
+/* shared memory - adds fail once the segment is full, reader processes attached to the segment see the writer's products */
+void testSharedMemory(void)
 {
-    Product* y, *newQuality, *newTimeRoot;
-
-    /* base case */
-    if (root == NULL)
+    const char* name = "/avl-self-test";
+    DataStructure *ds, *reader;
+    TestModel model;
+    unsigned long version;
+    char countText[16];
+    pid_t child;
+    int status, reaped, j, k;
+
+    shm_unlink(name);       /* segment left by a failed run */
+    ds = ShmCreate(name, 3, 32768);
+    CHECK(ds != NULL);
+    if (ds == NULL) return;
+
+    /* fill the segment */
+    model.count = 0;
+    for (j = 0; j < TEST_TIMES && AddProduct(ds, j, j % TEST_QUALITIES); j++)
     {
-        newQuality = createQualityNode(x->quality);                     /* create a quality node */
-        newTimeRoot = insertTime(newQuality->timeSubtree, x);           /* add product to quality's time subtree */
-        newQuality->timeSubtree = newTimeRoot;                          /* update new time subtree root */
-        newQuality->subtreeSize += newTimeRoot->subtreeSize;            /* add time subtree to subtree size */
-        return newQuality;
+        model.times[model.count] = j;
+        model.qualities[model.count] = j % TEST_QUALITIES;
+        model.count++;
     }
-    /* insert product to the left subtree */
-    if (x->quality < root->quality)
+    CHECK(j > 0 && j < TEST_TIMES);
+    CHECK(AddProduct(ds, TEST_TIMES, 0) == 0);
+    checkQueries(*ds, &model);
+
+    /* removed products make room again */
+    for (j = 0; j < 10; j++) testRemove(ds, &model, j);
+    for (j = 0; j < 10; j++) testAdd(ds, &model, j, 1);
+    checkQueries(*ds, &model);
+
+    /* a write changes the seqlock version */
+    version = ReadBegin(ds);
+    CHECK(version % 2 == 0 && ReadRetry(ds, version) == 0);
+    testRemove(ds, &model, 20);
+    CHECK(ReadRetry(ds, version) == 1);
+
+    /* reader process - maps the segment where the writer had it */
+    child = fork();
+    if (child == 0)
     {
-        y = insertQuality(root->left, x);
-        root->left = y;
-        y->parent = root;
-        root->height = y->height + 1;   /* update height */
+        ShmDetach(ds);
+        reader = ShmAttach(name);
+        CHECK(reader != NULL);
+        if (reader != NULL)
+        {
+            version = ReadBegin(reader);
+            checkQueries(*reader, &model);
+            CHECK(ReadRetry(reader, version) == 0);
+            ShmDetach(reader);
+        }
+        exit(testFailures > 0);
     }
-    /* insert product to the right subtree */
-    if (x->quality > root->quality)
+    CHECK(child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    /* started reader program - has its own address space layout, reads while the writer churns */
+    sprintf(countText, "%d", model.count);
+    child = fork();
+    if (child == 0)
     {
-        y = insertQuality(root->right, x);
-        root->right = y;
-        y->parent = root;
-        root->height = y->height + 1;   /* update height */
+        execl("/proc/self/exe", "self-test", "shm-reader", name, countText, (char*)NULL);
+        _exit(2);
     }
-    /* insert product to existing quality */
-    if (x->quality == root->quality)
+    reaped = 0;
+    for (j = 0; child > 0 && !reaped && j < 2000000; j++)
     {
-        newTimeRoot = insertTime(root->timeSubtree, x);             /* add product to quality's time subtree */
-        root->timeSubtree = newTimeRoot;                            /* update time subtree root */
-        root->subtreeSize++;                                        /* update subtree size */
-        return root;
+        k = j % model.count;
+        RemoveProduct(ds, model.times[k]);
+        AddProduct(ds, model.times[k], model.qualities[k]);
+        reaped = (waitpid(child, &status, WNOHANG) == child);
     }
-    root->subtreeSize++;    /* update subtree size */
-    root = balance(root);   /* balance the tree */
-    return root;
+    if (child > 0 && !reaped)       /* reader is stuck */
+    {
+        kill(child, SIGKILL);
+        waitpid(child, &status, 0);
+    }
+    CHECK(child > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    checkQueries(*ds, &model);
+    ShmDetach(ds);
+    shm_unlink(name);
 }
 
-/* returns the minimum product in tree (O(logn)) */
-Product* minProduct(Product* root)
-{
-    Product* current = root;
-    if (root == NULL) return NULL;
-    
-    /* go to the far left product */
-    while (current->left != NULL) current = current->left;
-    return current;
-}
+#endif
 
-/* returns maximum product in tree (O(logn)) */
-Product* maxProduct(Product* root)
+/* behaviour checks - build with -DSELF_TEST and the flags of the features to check, returns 1 if a check failed */
+int main(int argc, char** argv)
 {
-    Product* current = root;
-    if (root == NULL) return NULL;
-
-    /* go to the far right */
-    while (current->right != NULL) current = current->right;
-    return current;
+#ifdef SHARED_MEMORY
+    /* reader program started by testSharedMemory */
+    if (argc == 4 && strcmp(argv[1], "shm-reader") == 0) return shmReaderProgram(argv[2], atoi(argv[3]));
+#else
+    (void)argc;
+    (void)argv;
+#endif
+    srand(1);
+    testWriteBuffer();
+    testBalancing();
+    testKeyTypes();
+#ifdef PRODUCT_PAYLOAD_TYPE
+    testPayloads(0);
+    testPayloads(8);
+#endif
+    testMerge();
+    testBigMerge();
+#ifdef BUCKET_TIME_INDEX
+    testBucketIndex();
+#endif
+    testSmallInstance();
+    testTenants();
+#ifdef COMBINING_WRITER
+    testCombiningWriter();
+#endif
+    testBoxCounting();
+#ifdef ONLINE_COMPACTION
+    testCompaction();
+#endif
+#ifdef SHARED_MEMORY
+    testSharedMemory();
+#endif
+#ifdef QUERY_SERVER
+    testQueryServer();
+#endif
+#ifdef QUALITY_SKETCH
+    testQualitySketch();
+#endif
+#ifdef LAZY_DELETE
+    testLazyDelete();
+#endif
+
+    if (testFailures > 0)
+    {
+        printf("%d checks failed\n", testFailures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
 }
 
-/* removes a product from time tree and returns a pointer to new root (O(logn)) */
-Product* removeProductFromTime(Product* root, int time)
-{
-    Product *temp;
-
-    /* base case */
-    if (root == NULL) return NULL;
-
-    /* search left subtree */
-    if (root->time > time) root->left = removeProductFromTime(root->left, time);
+#elif defined(BALANCE_BENCHMARK)
 
-    /* search in right subtree */
-    else if (root->time < time) root->right = removeProductFromTime(root->right, time);
-
-    /* if we found the product to remove */
-    else
+/* runs n adds followed by n mixed operations with deletePercent deletes, prints and returns seconds, prints rotations */
+double benchmarkWorkload(const char* name, int n, int deletePercent)
+{
+    DataStructure ds = Init(0);
+    TimeType *times;
+    int count, next, j, k;
+    long rotationsBefore;
+    clock_t start;
+    double seconds;
+
+    times = (TimeType*)malloc(2 * n * sizeof(TimeType));
+    if (times == NULL) return 0;
+    srand(1);
+    start = clock();
+    rotationsBefore = rotationCount;
+
+    /* fill the data structure */
+    for (count = 0, next = 0; count < n; count++, next++)
     {
-        /* if it has one child or no children */
-        if (root->left == NULL || root->right == NULL)
+        times[count] = next * 7919 % (4 * n);   /* spread times */
+        AddProduct(&ds, times[count], rand() % 1000);
+    }
+    /* mixed operations */
+    for (j = 0; j < n; j++)
+    {
+        if (count > 0 && rand() % 100 < deletePercent)
         {
-            if (root->left == NULL) temp = root->right;
-            else if (root->right == NULL) temp = root->left;
-
-            /* check if product to delete is minimum quality */
-            if (root->parent && root->parent->minQualityP->time == root->time) root->parent->minQualityP = NULL;
-
-            /* update parent pointers */
-            if (temp) temp->parent = root->parent;
-
-            free(root);
-            return temp;
+            k = rand() % count;
+            RemoveProduct(&ds, times[k]);
+            times[k] = times[--count];
+        }
+        else
+        {
+            times[count] = 4 * n + next++;
+            AddProduct(&ds, times[count++], rand() % 1000);
         }
-        /* if it has two children */
-        temp = minProduct(root->right);                                 /* find successor */
-        swapProduct(root, temp);                                        /* root = successor */
-        root->right = removeProductFromTime(root->right, temp->time);   /* remove successor place product */
     }
-    /* if it has only one node */
-    if (root == NULL) return root;
+    seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%-14s %-5s %8.3f sec %10ld rotations\n", name, (balancePolicy == WAVL_POLICY ? "WAVL" : "AVL"), seconds, rotationCount - rotationsBefore);
 
-    /* update height of current node and balance the tree */
-    updateHeight(root);
-    updateMinQuality(root);
-    root->subtreeSize--;
-    return balance(root);
+    /* empty the data structure */
+    while (count > 0) RemoveProduct(&ds, times[--count]);
+    free(times);
+    return seconds;
 }
 
-/* removes a product from quality tree and returns new root (O(logn)) */
-Product* removeProductFromQuality(Product* root, int time, int quality)
+/* compare balancing policies - runs every workload with each policy and prints the faster one per workload, build with -DBALANCE_BENCHMARK */
+int main()
 {
-    Product* temp, *newTimeRoot;
+    const char* workloads[] = { "insert heavy", "mixed", "delete heavy" };
+    int deletePercents[] = { 10, 50, 90 };
+    double avlSeconds, wavlSeconds;
+    int j;
 
-    /* base case */
-    if (root == NULL) return NULL;
+    for (j = 0; j < 3; j++)
+    {
+        balancePolicy = AVL_POLICY;
+        avlSeconds = benchmarkWorkload(workloads[j], 200000, deletePercents[j]);
+        balancePolicy = WAVL_POLICY;
+        wavlSeconds = benchmarkWorkload(workloads[j], 200000, deletePercents[j]);
+        printf("%-14s build with -DBALANCE_POLICY=%s\n\n", workloads[j], (wavlSeconds < avlSeconds ? "WAVL_POLICY" : "AVL_POLICY"));
+    }
+    return 0;
+}
 
-    /* search left subtree */
-    if (root->quality > quality) root->left = removeProductFromQuality(root->left, time, quality);
+#elif defined(COMBINING_BENCHMARK) && defined(COMBINING_WRITER)
 
-    /* search right subtree */
-    else if (root->quality < quality) root->right = removeProductFromQuality(root->right, time, quality);
+#define BENCHMARK_OPERATIONS 300000      /* operations per run, split between the threads */
+#define BENCHMARK_WINDOW 64               /* operations in flight per thread for asynchronous submission */
 
-    /* found quality */
-    else
-    {
-        /* remove product from time subtree (O(logn)) */
-       newTimeRoot = NULL;
-        if (root->timeSubtree != NULL) newTimeRoot = removeProductFromTime(root->timeSubtree, time);
+/* producer thread arguments */
+typedef struct BenchmarkThread {
+    CombiningWriter* writer;   /* combiner, NULL for mutex */
+    int window;                /* operations submitted before waiting, 0 for synchronous calls */
+    DataStructure* ds;         /* data structure for mutex */
+    pthread_mutex_t* lock;
+    int first;                 /* first time of thread */
+    int count;                 /* number of products of thread */
+    pthread_t thread;
+} BenchmarkThread;
 
-        if (newTimeRoot == NULL)    /* remove quality node */
-        {
-            if (root->quality == quality) root->timeSubtree = NULL;
+/* producer - adds count products and removes every third one after adding it */
+void* benchmarkProducer(void* arg)
+{
+    BenchmarkThread* b = (BenchmarkThread*)arg;
+    CombiningOperation operations[BENCHMARK_WINDOW];
+    int j, k, time;
 
-            /* if it has one child or no children */
-            if (root->left == NULL || root->right == NULL)
+    for (j = 0; j < b->count; j++)
+    {
+        time = (int)((b->first + j) * 2654435761u % 1000000007u);  /* spread times */
+        if (j % 3 == 2) time = (int)((b->first + j - 1) * 2654435761u % 1000000007u);
+        if (b->window > 0)
+        {
+            /* asynchronous - wait for the whole window once it is full */
+            k = j % b->window;
+            operations[k].type = (j % 3 == 2 ? OPERATION_REMOVE : OPERATION_ADD);
+            operations[k].time = time;
+            operations[k].quality = time % 1000;
+            operations[k].callback = NULL;
+            SubmitOperation(b->writer, &operations[k]);
+            if (k == b->window - 1 || j == b->count - 1)
             {
-                if (root->left == NULL) temp = root->right;
-                else if (root->right == NULL) temp = root->left;
-                if (temp) temp->parent = root->parent;                          /* update parent pointers */
-                free(root);
-                root = NULL;
-                return temp;
+                for (; k >= 0; k--) WaitOperation(&operations[k]);
             }
-            /* if it has two children */
-            temp = minProduct(root->right);                                             /* find successor */
-            swapProduct(root, temp);                                                    /* root = successor */
-            root->right = removeProductFromQuality(root->right, -1, temp->quality);     /* remove successor place product */
         }
-        root->timeSubtree = newTimeRoot;    /* update time subtree */
+        else if (b->writer != NULL)
+        {
+            if (j % 3 == 2) CombinedRemoveProduct(b->writer, time);
+            else CombinedAddProduct(b->writer, time, time % 1000);
+        }
+        else
+        {
+            pthread_mutex_lock(b->lock);
+            if (j % 3 == 2) RemoveProduct(b->ds, time);
+            else AddProduct(b->ds, time, time % 1000);
+            pthread_mutex_unlock(b->lock);
+        }
     }
-    /* if it has only one node */
-    if (root == NULL) return root;
-
-    /* update height and subtree size of current node and balance the tree */
-    updateHeight(root);
-    root->subtreeSize--;
-    return balance(root);
+    return NULL;
 }
 
-/* returns time subtree size of a quality type node */
-int timeSubtreeSize(Product* qualityRoot)
+/* runs threads producers with a mutex, or with a combiner and window operations in flight, returns operations per second */
+double benchmarkProducers(int threads, int combining, int window)
 {
-    if (qualityRoot == NULL || qualityRoot->timeSubtree == NULL) return 0;
-    return qualityRoot->timeSubtree->subtreeSize;
+    DataStructure ds = Init(0);
+    BenchmarkThread b[64];
+    pthread_mutex_t lock;
+    CombiningWriter* writer = NULL;
+    struct timespec start, end;
+    int j;
+
+    pthread_mutex_init(&lock, NULL);
+    if (combining) writer = StartCombiner(&ds);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (j = 0; j < threads; j++)
+    {
+        b[j].writer = writer;
+        b[j].window = window;
+        b[j].ds = &ds;
+        b[j].lock = &lock;
+        b[j].count = BENCHMARK_OPERATIONS / threads;
+        b[j].first = j * b[j].count;
+        pthread_create(&b[j].thread, NULL, benchmarkProducer, &b[j]);
+    }
+    for (j = 0; j < threads; j++) pthread_join(b[j].thread, NULL);
+    if (combining) StopCombiner(writer);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_destroy(&lock);
+
+    /* empty the data structure */
+    while (ds.timeRoot != NULL) RemoveProduct(&ds, ds.timeRoot->time);
+    return (threads * (BENCHMARK_OPERATIONS / threads)) / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
 }
 
-/* gets time root and returns the ith product (O(logn)) */
-Product* findIthTime(Product* root, int i)
+/* compare combining writer with a mutex - build with -DCOMBINING_WRITER -DCOMBINING_BENCHMARK -pthread */
+int main()
 {
-    int leftSize;
-    
-    if (root == NULL) return NULL;  /* base case */
+    int threads;
 
-    leftSize = (root->left ? root->left->subtreeSize : 0);
-
-    /* if i is out of range */
-    if (i < 1 || i > root->subtreeSize) return NULL;
+    printf("%8s %16s %16s %16s\n", "threads", "mutex ops/sec", "combiner sync", "combiner async");
+    for (threads = 1; threads <= 64; threads *= 2)
+    {
+        printf("%8d %16.0f", threads, benchmarkProducers(threads, 0, 0));
+        printf(" %16.0f", benchmarkProducers(threads, 1, 0));
+        printf(" %16.0f\n", benchmarkProducers(threads, 1, BENCHMARK_WINDOW));
+    }
+    return 0;
+}
 
-    /* found i-th rank product */
-    if (i == leftSize + 1) return root;
+#elif defined(COMPACTION_BENCHMARK) && defined(ONLINE_COMPACTION)
 
-    /* check left subtree */
-    else if (i <= leftSize) return findIthTime(root->left, i);
+#define BENCHMARK_PRODUCTS 1000000     /* products in data structure */
+#define BENCHMARK_SLICE 1024           /* products moved per compaction step */
 
-    /* check right subtree */
-    else return findIthTime(root->right, i - leftSize - 1);
+/* returns resident memory in bytes, 0 if unknown */
+long residentBytes(void)
+{
+    long pages = 0;
+#ifdef __GLIBC__
+    long size;
+    FILE* statm;
+
+    malloc_trim(0);     /* counts freed products as returned */
+    statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) return 0;
+    if (fscanf(statm, "%ld %ld", &size, &pages) != 2) pages = 0;
+    fclose(statm);
+    pages *= sysconf(_SC_PAGESIZE);
+#endif
+    return pages;
 }
 
-/* gets quality tree root and returns the i-th rank product (O(logn)) */
-Product* findIthQuality(Product* root, int i)
+/* compaction of a churned data structure - build with -DONLINE_COMPACTION -DCOMPACTION_BENCHMARK */
+int main()
 {
-    int leftSize;
-    
-    if (root == NULL) return NULL;   /* base case */
-
-    leftSize = (root->left ? root->left->subtreeSize : 0);
-
-    /* if i is out of range */
-    if (i < 1 || i > root->subtreeSize) return NULL;
+    DataStructure ds = Init(0);
+    CompactionReport report = {0, 0, 0};
+    struct timespec start, end;
+    double before, step, longest = 0;
+    long residentBefore;
+    TimeType* times;
+    int j, k, steps = 0, finished = 0;
+
+    times = (TimeType*)malloc(BENCHMARK_PRODUCTS * sizeof(TimeType));
+    if (times == NULL) return 1;
+    srand(1);
+
+    /* fill, then replace products at random for a while so they are scattered on the heap */
+    for (j = 0; j < BENCHMARK_PRODUCTS; j++)
+    {
+        times[j] = j;
+        AddProduct(&ds, times[j], rand() % 1000);
+    }
+    for (j = 0; j < 2 * BENCHMARK_PRODUCTS; j++)
+    {
+        k = rand() % BENCHMARK_PRODUCTS;
+        RemoveProduct(&ds, times[k]);
+        times[k] = BENCHMARK_PRODUCTS + j;
+        AddProduct(&ds, times[k], rand() % 1000);
+    }
+    before = TraversalTime(ds);
+    residentBefore = residentBytes();
 
-    /* ith product is in current node time subtree */
-    if (i > leftSize && i <= leftSize + timeSubtreeSize(root))
+    /* compaction pass in slices */
+    while (!finished)
     {
-        return findIthTime(root->timeSubtree, i - leftSize);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        finished = CompactStep(&ds, BENCHMARK_SLICE, &report);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        step = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+        longest = max(longest, step);
+        steps++;
     }
 
-    /* ith product is in left subtree */
-    else if (i <= leftSize) return findIthQuality(root->left, i);
+    printf("moved %ld products in %d steps, longest step %.0f us\n", report.moved, steps, longest);
+    printf("released %ld bytes, compaction blocks %ld bytes\n", report.releasedBytes, report.blockBytes);
+    printf("resident memory %ld -> %ld bytes\n", residentBefore, residentBytes());
+    printf("traversal %.2f -> %.2f ns per product\n", before, TraversalTime(ds));
 
-    /* ith product is in right subtree */
-    else return findIthQuality(root->right, i - leftSize - timeSubtreeSize(root));
+    freeInstance(&ds);
+    free(times);
+    return 0;
 }
 
-/* returns if a products time is between time1 and time2 */
-int isInRange(Product* x, int time1, int time2)
-{
-    if (x == NULL) return 0;
-    return (x->time >= time1 && x->time <= time2);
-}
+#elif defined(QUERY_SERVER)
 
-/* find product by time or its successor if doesnt exists (O(logn)) */
-Product* findTimeOrSuccessor(Product* root, int time)
+/* client connection of query server */
+typedef struct ServerConnection {
+    int fd;
+    int inBytes;               /* bytes read into input, a partial request may be last */
+    int outBytes;              /* bytes of output to send */
+    int outSent;               /* bytes of output sent so far */
+    ServerRequest input[SERVER_BATCH];
+    ServerResponse output[SERVER_BATCH];
+} ServerConnection;
+
+/* sends pending output, returns 0 if connection failed */
+int serverFlush(ServerConnection* connection)
 {
-    Product* successor = NULL;
-    while (root != NULL)
+    ssize_t sent;
+    while (connection->outSent < connection->outBytes)
     {
-        if (root->time > time)
-        {
-            successor = root;
-            root = root->left;
-        }
-        else if (root->time < time) root = root->right;
-        else return root;   /* found time */
+        sent = write(connection->fd, (char*)connection->output + connection->outSent, connection->outBytes - connection->outSent);
+        if (sent < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        connection->outSent += sent;
     }
-    return successor;       /* time not found, return successor */
+    connection->outBytes = 0;
+    connection->outSent = 0;
+    return 1;
 }
 
-/* find product by time or predecessor if doesnt exists (O(logn)) */
-Product* findTimeOrPredecessor(Product* root, int time)
+/* reads and answers available requests, returns 0 if connection is closed or failed */
+int serverRead(DataStructure* ds, ServerConnection* connection)
 {
-    Product* predecessor = NULL;
-    while (root != NULL)
-    {
-        if (root->time < time)
-        {
-            predecessor = root;
-            root = root->right;
-        }
-        else if (root->time > time) root = root->left;
-        else return root;       /* found time */
-    }
-    return predecessor;         /* time not found, return predecessor */
+    ssize_t got;
+    int count;
+
+    got = read(connection->fd, (char*)connection->input + connection->inBytes, sizeof(connection->input) - connection->inBytes);
+    if (got == 0) return 0;
+    if (got < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+    connection->inBytes += got;
+
+    /* answer complete requests, keep partial one */
+    count = connection->inBytes / sizeof(ServerRequest);
+    if (count == 0) return 1;
+    serveBatch(ds, connection->input, count, connection->output);
+    connection->inBytes -= count * sizeof(ServerRequest);
+    memmove(connection->input, connection->input + count, connection->inBytes);
+    connection->outBytes = count * sizeof(ServerResponse);
+    connection->outSent = 0;
+    return serverFlush(connection);
 }
 
-/* compare minimum product pointer between root and right subtree (for when root is left child) */
-Product* minProductLeft(Product* root, Product* min, int time1, int time2)
+/* Unix socket server of one data structure - build with -DQUERY_SERVER, run as server [socket path] */
+int main(int argc, char** argv)
 {
-    /* empty tree */
-    if (root == NULL) return NULL;
-
-    /* search left subtree */
-    if (root->time > time1)
+    DataStructure ds = InitBuffered(0, SERVER_BUFFER);
+    struct sockaddr_un address;
+    struct epoll_event event, events[64];
+    ServerConnection* connection;
+    const char* path = (argc > 1 ? argv[1] : SERVER_SOCKET);
+    int listener, epoll, fd, ready, j;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* listening socket */
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    unlink(path);
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 128) < 0)
     {
-        min = minProductLeft(root->left, min, time1, time2);
-        if (root->right && isInRange(root->right, time1, time2)) min = minOfTwoProducts(root->right->minQualityP, min);
-        if (isInRange(root, time1, time2)) min = minOfTwoProducts(root, min);
-        return min;
+        perror("server");
+        return 1;
     }
-    /* search right subtree */
-    else if (root->time < time1)
+    epoll = epoll_create1(0);
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;      /* NULL marks the listener */
+    if (epoll < 0 || epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &event) < 0)
     {
-        min = minProductLeft(root->right, min, time1, time2);
-        return min;
+        perror("server");
+        return 1;
     }
-    /* found product */
-    else
+    printf("serving on %s\n", path);
+    fflush(stdout);
+
+    while (1)
     {
-        min = root;
-        if (root->right && isInRange(root->right, time1, time2)) return minOfTwoProducts(min, root->right->minQualityP);
+        ready = epoll_wait(epoll, events, 64, -1);
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("server");
+            return 1;
+        }
+        for (j = 0; j < ready; j++)
+        {
+            connection = (ServerConnection*)events[j].data.ptr;
+
+            /* new connections */
+            if (connection == NULL)
+            {
+                while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+                {
+                    connection = (ServerConnection*)malloc(sizeof(ServerConnection));
+                    if (connection == NULL)
+                    {
+                        close(fd);
+                        continue;
+                    }
+                    connection->fd = fd;
+                    connection->inBytes = 0;
+                    connection->outBytes = 0;
+                    connection->outSent = 0;
+                    event.events = EPOLLIN;
+                    event.data.ptr = connection;
+                    if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+                    {
+                        close(fd);
+                        free(connection);
+                    }
+                }
+                continue;
+            }
+
+            /* answers are sent before more requests are read, so a client that does not read stops being served */
+            event.events = EPOLLIN;
+            event.data.ptr = connection;
+            if (connection->outBytes > 0 ? !serverFlush(connection) : !serverRead(&ds, connection))
+            {
+                epoll_ctl(epoll, EPOLL_CTL_DEL, connection->fd, NULL);
+                close(connection->fd);
+                free(connection);
+                continue;
+            }
+            if (connection->outBytes > 0) event.events = EPOLLOUT;
+            if (epoll_ctl(epoll, EPOLL_CTL_MOD, connection->fd, &event) < 0)
+            {
+                close(connection->fd);      /* closing removes it from epoll */
+                free(connection);
+            }
+        }
     }
-    return min;
+    return 0;
 }
 
-/* compare minimum product pointer between root and left subtree (for when root is right child) */
-Product* minProductRight(Product* root, Product* min, int time1, int time2)
+#elif defined(QUERY_LOADGEN)
+
+/* load generator connection thread */
+typedef struct LoadThread {
+    const char* path;          /* server socket */
+    int first;                 /* first time of thread's products */
+    int count;                 /* requests to send */
+    int depth;                 /* requests in flight */
+    double* latencies;         /* microseconds per request */
+    int failed;
+    pthread_t thread;
+} LoadThread;
+
+/* returns current time in microseconds */
+double loadNow(void)
 {
-    /* empty tree */
-    if (root == NULL) return NULL;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
 
-    /* search left subtree */
-    if (root->time > time2)
+/* fills a request of the mix - 30% adds, 10% removes, 60% queries */
+void loadRequest(LoadThread* load, ServerRequest* request, int j, unsigned int* seed)
+{
+    int kind = rand_r(seed) % 100;
+
+    memset(request, 0, sizeof(ServerRequest));
+    request->time1 = load->first + j;
+    request->quality = rand_r(seed) % 1000;
+    if (kind < 30) request->operation = SERVER_ADD;
+    else if (kind < 40)
     {
-        min = minProductRight(root->left, min, time1, time2);
-        return min;
+        request->operation = SERVER_REMOVE;
+        request->time1 = load->first + rand_r(seed) % (j + 1);
     }
-    /* search right subtree */
-    else if (root->time < time2)
+    else if (kind < 70)
     {
-        min = minProductRight(root->right, min, time1, time2);
-        if (root->left && isInRange(root->left, time1, time2)) min = minOfTwoProducts(root->left->minQualityP, min);
-        if (isInRange(root, time1, time2)) min = minOfTwoProducts(root, min);
-        return min;
+        request->operation = SERVER_ITH;
+        request->rank = 1 + rand_r(seed) % 100;
     }
-    /* found product */
-    else
+    else if (kind < 95)
     {
-        min = root;
-        if (root->left && isInRange(root->left, time1, time2)) return minOfTwoProducts(min, root->left->minQualityP);
+        request->operation = SERVER_ITH_BETWEEN;
+        request->time1 = load->first + rand_r(seed) % (j + 1);
+        request->time2 = request->time1 + 1000;
+        request->rank = 1 + rand_r(seed) % 10;
     }
-    return min;
+    else request->operation = SERVER_EXISTS;
 }
 
-/* returns minimum product between time1 and time2 */
-Product* findMinQualityBetween(Product* root, int left, int right)
+/* sends count pipelined requests on one connection, keeping depth of them in flight */
+void* loadThread(void* argument)
 {
-    Product* minLeft, *minRight;
-    
-    /* empty tree */
-    if (root == NULL) return NULL;
-
-    /* find minimum quality in range */
-    minLeft = minProductLeft(root, minLeft, left, right);
-    minRight = minProductRight(root, minRight, left, right);
+    LoadThread* load = (LoadThread*)argument;
+    struct sockaddr_un address;
+    ServerRequest* requests;
+    ServerResponse* responses;
+    double* sendTimes;
+    unsigned int seed = load->first;
+    int fd, sent = 0, received = 0, batch, j;
+    ssize_t done, got, have = 0;
+
+    requests = (ServerRequest*)malloc(load->depth * sizeof(ServerRequest));
+    responses = (ServerResponse*)malloc(load->depth * sizeof(ServerResponse));
+    sendTimes = (double*)malloc(load->count * sizeof(double));
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, load->path, sizeof(address.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (requests == NULL || responses == NULL || sendTimes == NULL || fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0)
+    {
+        load->failed = 1;
+        received = load->count;
+    }
 
-    /* return minimum between left and right */
-    if (minLeft == minRight) return minLeft;
-    else return minOfTwoProducts(minLeft, minRight);
+    while (received < load->count)
+    {
+        /* top up requests in flight with one write */
+        batch = min(load->depth - (sent - received), load->count - sent);
+        for (j = 0; j < batch; j++)
+        {
+            loadRequest(load, &requests[j], sent + j, &seed);
+            sendTimes[sent + j] = loadNow();
+        }
+        for (done = 0, got = 1; done < batch * (ssize_t)sizeof(ServerRequest); done += got)
+        {
+            got = write(fd, (char*)requests + done, batch * sizeof(ServerRequest) - done);
+            if (got <= 0) break;
+        }
+        if (got <= 0) break;
+        sent += batch;
+
+        /* take answered responses */
+        got = read(fd, (char*)responses + have, (sent - received) * sizeof(ServerResponse) - have);
+        if (got <= 0) break;
+        have += got;
+        for (j = 0; j < have / (ssize_t)sizeof(ServerResponse); j++, received++) load->latencies[received] = loadNow() - sendTimes[received];
+        have -= j * sizeof(ServerResponse);
+        memmove(responses, responses + j, have);
+    }
+    if (received < load->count) load->failed = 1;
+    if (fd >= 0) close(fd);
+    free(requests);
+    free(responses);
+    free(sendTimes);
+    return NULL;
 }
 
-/* returns how many products are between time1 and time2 O(logn) */
-int countProducts(Product* root, int time1, int time2)
+/* sorts latencies */
+int compareLatencies(const void* a, const void* b)
 {
-    if (root == NULL) return 0;
-    if (root->time < time1) return countProducts(root->right, time1, time2);
-    if (root->time > time2) return countProducts(root->left, time1, time2);
-    return 1 + countProducts(root->left, time1, time2) + countProducts(root->right, time1, time2);
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
 }
 
-/* update given time product's quality to new */
-Product* updateToNewQuality(Product* root, int time, int newQuality)
+/* load generator of query server - build with -DQUERY_LOADGEN -pthread, run as loadgen [socket path] [connections] [requests] [depth] */
+int main(int argc, char** argv)
 {
-    if (root->time > time)
+    const char* path = (argc > 1 ? argv[1] : SERVER_SOCKET);
+    int connections = (argc > 2 ? atoi(argv[2]) : 4);
+    int count = (argc > 3 ? atoi(argv[3]) : 100000);
+    int depth = (argc > 4 ? atoi(argv[4]) : 32);
+    LoadThread* loads;
+    double *latencies, start, seconds;
+    int j, total;
+
+    if (connections < 1 || count < 1 || depth < 1) return 1;
+    loads = (LoadThread*)malloc(connections * sizeof(LoadThread));
+    latencies = (double*)malloc((size_t)connections * count * sizeof(double));
+    if (loads == NULL || latencies == NULL) return 1;
+
+    /* connections run at once, each on its own times */
+    start = loadNow();
+    for (j = 0; j < connections; j++)
     {
-        root->left = updateToNewQuality(root->left, time, newQuality);
+        loads[j].path = path;
+        loads[j].first = j * count;
+        loads[j].count = count;
+        loads[j].depth = min(depth, SERVER_BATCH);
+        loads[j].latencies = latencies + (size_t)j * count;
+        loads[j].failed = 0;
+        pthread_create(&loads[j].thread, NULL, loadThread, &loads[j]);
     }
-    if (root->time < time)
+    for (j = 0; j < connections; j++) pthread_join(loads[j].thread, NULL);
+    seconds = (loadNow() - start) / 1e6;
+    for (j = 0; j < connections; j++)
     {
-        root->right = updateToNewQuality(root->right, time, newQuality);
+        if (loads[j].failed)
+        {
+            fprintf(stderr, "connection %d to %s failed\n", j, path);
+            return 1;
+        }
     }
-    else if (root->time == time) root->quality = newQuality;
 
-    return root;
+    total = connections * count;
+    qsort(latencies, total, sizeof(double), compareLatencies);
+    printf("%d connections, depth %d: %.0f requests/sec\n", connections, min(depth, SERVER_BATCH), total / seconds);
+    printf("latency us: p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", latencies[total / 2], latencies[(int)(total * 0.99)],
+           latencies[(int)(total * 0.999)], latencies[total - 1]);
+    free(loads);
+    free(latencies);
+    return 0;
 }
 
+#else
+
 int main()
 {
     int current;
@@ -950,4 +6657,6 @@ int main()
     printf("%d \n", current);
     
     return 0;
-}
\ No newline at end of file
+}
+
+#endif